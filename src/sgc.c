@@ -1,9 +1,27 @@
+#define _GNU_SOURCE /* mremap() */
 #include "sgc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #ifdef SGC_DEBUG
 #include <stdio.h>
 #endif
 
+#ifdef SGC_PROFILE
+/* the functions are defined here, not the macros from sgc.h */
+#undef sgc_malloc
+#undef sgc_realloc
+#undef sgc_calloc
+#undef sgc_malloc_typed
+#endif
+
 SGC *sgc;
 
 /**
@@ -117,8 +135,13 @@ static void adjustSlotsCapacity(int capacity) {
     slot->size = 0;
     slot->flags = SLOT_UNUSED;
     slot->address = 0;
+    slot->descriptor = NULL;
 #ifdef SGC_DEBUG
     slot->id = -1;
+#endif
+#ifdef SGC_PROFILE
+    slot->file = NULL;
+    slot->line = 0;
 #endif
   }
 
@@ -133,12 +156,27 @@ static void adjustSlotsCapacity(int capacity) {
     newSlot->address = slot->address;
 #ifdef SGC_DEBUG
     newSlot->id = slot->id;
+#endif
+#ifdef SGC_PROFILE
+    newSlot->file = slot->file;
+    newSlot->line = slot->line;
 #endif
     newSlot->size = slot->size;
     newSlot->flags = slot->flags;
+    newSlot->descriptor = slot->descriptor;
     sgc->slotsCount++;
   }
 
+  /* a concurrent marker thread might have slots of the old table on the
+   * gray list */
+  int grayCount = 0;
+  for (int i = 0; i < sgc->grayCount; i++) {
+    SGC_Slot *slot = sgc->grayList[i];
+    if (slot->flags & SLOT_IN_USE)
+      sgc->grayList[grayCount++] = findSlot(slot->address);
+  }
+  sgc->grayCount = grayCount;
+
   /* free old table */
   free(oldSlots);
 }
@@ -183,6 +221,11 @@ static SGC_Slot *getSlot(uintptr_t address) {
 #ifdef SGC_DEBUG
     slot->id = sgc->lastId++;
 #endif
+#ifdef SGC_PROFILE
+    slot->file = NULL;
+    slot->line = 0;
+#endif
+    slot->descriptor = NULL;
   }
   return slot;
 }
@@ -204,14 +247,468 @@ void markGray(SGC_Slot *slot) {
   sgc->grayList[sgc->grayCount++] = slot;
 }
 
+/**
+ * Get the page number of an address, as used by the blacklist.
+ * @param   address memory address
+ * @return  page number
+ */
+static uintptr_t pageOf(uintptr_t address) {
+  return address >> BLACKLIST_PAGE_SHIFT;
+}
+
+/**
+ * Find the entry for page in the blacklist hash set (same probing as
+ * findSlot(), but without tombstones since pages are never removed one by
+ * one).
+ * @param   page page number
+ * @return  entry holding page or empty entry. NULL if capacity is 0
+ */
+static uintptr_t *findBlacklistEntry(uintptr_t page) {
+  if (sgc->blacklistCapacity == 0)
+    return NULL;
+  uint32_t idx = hashAddress(page) % sgc->blacklistCapacity;
+  while (sgc->blacklist[idx] != 0 && sgc->blacklist[idx] != page) {
+    idx = (idx + 1) % sgc->blacklistCapacity;
+  }
+  return &sgc->blacklist[idx];
+}
+
+/**
+ * Check if the page of address is blacklisted.
+ * @param   address memory address
+ * @return  1 if blacklisted, 0 otherwise
+ */
+static int isBlacklisted(uintptr_t address) {
+  uintptr_t *entry = findBlacklistEntry(pageOf(address));
+  return entry != NULL && *entry != 0;
+}
+
+/**
+ * Blacklist the page of address. Grow the hash set if necessary.
+ * @param   address memory address a false pointer was found for
+ */
+static void blacklistAddress(uintptr_t address) {
+  uintptr_t page = pageOf(address);
+  if (page == 0)
+    return;
+  sgc->stats.falsePointers++;
+  uintptr_t *entry = findBlacklistEntry(page);
+  if (entry != NULL && *entry == page)
+    return; /* already blacklisted */
+
+  if (entry == NULL ||
+      sgc->blacklistCount + 1 > sgc->blacklistCapacity * SLOTS_MAX_LOAD) {
+    uintptr_t *oldBlacklist = sgc->blacklist;
+    int oldCapacity = sgc->blacklistCapacity;
+    sgc->blacklistCapacity = oldCapacity == 0
+                                 ? SLOTS_INITIAL_CAPACITY
+                                 : oldCapacity * SLOTS_GROW_FACTOR;
+    sgc->blacklist = calloc(sgc->blacklistCapacity, sizeof(uintptr_t));
+    if (sgc->blacklist == NULL)
+      exit(1);
+    /* copy old pages to new set */
+    for (int i = 0; i < oldCapacity; i++) {
+      if (oldBlacklist[i] != 0)
+        *findBlacklistEntry(oldBlacklist[i]) = oldBlacklist[i];
+    }
+    free(oldBlacklist);
+    entry = findBlacklistEntry(page);
+  }
+
+#ifdef SGC_DEBUG
+  printf("   blacklist page %p\n", (void *)(page << BLACKLIST_PAGE_SHIFT));
+#endif
+  *entry = page;
+  sgc->blacklistCount++;
+}
+
+/**
+ * Remove all pages from the blacklist. It's rebuild during every collection.
+ */
+static void clearBlacklist() {
+  for (int i = 0; i < sgc->blacklistCapacity; i++) {
+    sgc->blacklist[i] = 0;
+  }
+  sgc->blacklistCount = 0;
+  sgc->stats.falsePointers = 0;
+}
+
+/**
+ * Check if an allocation gets its own anonymous mapping.
+ * @param   size size of the allocation
+ */
+static int isLarge(size_t size) { return size >= LARGE_ALLOCATION_SIZE; }
+
+/**
+ * Round size up to whole pages.
+ */
+static size_t mappingSize(size_t size) {
+  size_t pageSize = (size_t)1 << SYSTEM_PAGE_SHIFT;
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+/**
+ * Get memory from the system for an allocation of size bytes.
+ * Large allocations get a fresh anonymous mapping, whose pages the kernel
+ * fills with zeros when they are touched first. Others come from malloc(),
+ * or calloc() if zero is set, which doesn't clear memory that wasn't used
+ * before either.
+ * @param   size number of bytes to allocate
+ * @param   zero if not 0 the memory is set to zero
+ * @return  allocated memory or NULL
+ */
+static void *obtainMemory(size_t size, int zero) {
+  if (isLarge(size)) {
+    void *address = mmap(NULL, mappingSize(size), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return address == MAP_FAILED ? NULL : address;
+  }
+  return zero ? calloc(1, size) : malloc(size);
+}
+
+/**
+ * Give memory back to the system.
+ * @param   address memory returned by obtainMemory()
+ * @param   size size of the memory
+ * @param   flags SLOT_MAPPED if it's a mapping
+ */
+static void releaseMemory(void *address, size_t size, Flags flags) {
+  if (flags & SLOT_MAPPED)
+    munmap(address, mappingSize(size));
+  else
+    free(address);
+}
+
+/**
+ * Keep memory from malloc() that landed on a blacklisted page out of use.
+ * @param   address memory returned by obtainMemory()
+ * @param   size size of the memory
+ */
+static void holdMemory(void *address, size_t size) {
+  if (sgc->heldCount + 1 >= sgc->heldCapacity) {
+    sgc->heldCapacity = sgc->heldCapacity == 0
+                            ? SLOTS_INITIAL_CAPACITY
+                            : sgc->heldCapacity * SLOTS_GROW_FACTOR;
+    sgc->heldList =
+        realloc(sgc->heldList, sgc->heldCapacity * sizeof(SGC_Held));
+    if (sgc->heldList == NULL)
+      exit(1);
+  }
+#ifdef SGC_DEBUG
+  printf("   hold back %p (blacklisted)\n", address);
+#endif
+  SGC_Held *held = &sgc->heldList[sgc->heldCount++];
+  held->address = (uintptr_t)address;
+  held->size = size;
+  held->collection = sgc->stats.collections;
+  sgc->stats.blacklistedBytes += size;
+}
+
+/**
+ * Check if size more bytes can be held back without exceeding
+ * BLACKLIST_MAX_HELD.
+ */
+static int canHoldMemory(size_t size) {
+  return sgc->stats.blacklistedBytes + size <= BLACKLIST_MAX_HELD;
+}
+
+/**
+ * Give held back memory back to the system if its page is not blacklisted
+ * anymore or it was held for BLACKLIST_HOLD_COLLECTIONS collections.
+ * Stale copies of its address (e.g. in dead stack frames) are false pointers
+ * that may keep its page blacklisted forever, since it never gets a slot.
+ * @param   all if not 0 release all held back memory
+ */
+static void releaseHeldMemory(int all) {
+  int i = 0;
+  while (i < sgc->heldCount) {
+    SGC_Held *held = &sgc->heldList[i];
+    if (!all && isBlacklisted(held->address) &&
+        sgc->stats.collections - held->collection <
+            BLACKLIST_HOLD_COLLECTIONS) {
+      i++;
+      continue;
+    }
+    free((void *)held->address);
+    sgc->stats.blacklistedBytes -= held->size;
+    /* fill the gap with the last element */
+    *held = sgc->heldList[--sgc->heldCount];
+  }
+}
+
+/**
+ * Replace a mapping that starts on a blacklisted page. A new mapping with
+ * BLACKLIST_MAX_RETRIES spare pages in front is made, and the mapping
+ * starts at the first of those pages that isn't blacklisted. The pages
+ * that aren't needed are unmapped again, so nothing is held back.
+ * @param   address mapping returned by obtainMemory()
+ * @param   size size of the memory
+ * @return  the new mapping, address if it can't be replaced
+ */
+static void *remapMemory(void *address, size_t size) {
+  size_t pageSize = (size_t)1 << SYSTEM_PAGE_SHIFT;
+  size_t spare = BLACKLIST_MAX_RETRIES * pageSize;
+  uint8_t *mapping = mmap(NULL, mappingSize(size) + spare,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return address;
+  munmap(address, mappingSize(size));
+
+  size_t offset = 0;
+  while (offset < spare && isBlacklisted((uintptr_t)mapping + offset))
+    offset += pageSize;
+  /* all blacklisted, use it anyway */
+  if (offset == spare)
+    offset = 0;
+  if (offset > 0)
+    munmap(mapping, offset);
+  if (offset < spare)
+    munmap(mapping + offset + mappingSize(size), spare - offset);
+#ifdef SGC_DEBUG
+  printf("   remap %p to %p (blacklisted)\n", address, mapping + offset);
+#endif
+  return mapping + offset;
+}
+
+/**
+ * Allocate memory with obtainMemory() but avoid blacklisted pages.
+ *
+ * Since a false pointer only retains memory whose address it is equal to,
+ * only the page the memory starts on is checked. If memory from malloc()
+ * is on a blacklisted page, it is held back together with a filler that
+ * uses up the rest of the page, so malloc() most likely continues on
+ * another page. If it keeps returning blacklisted memory give up after
+ * BLACKLIST_MAX_RETRIES attempts, or when BLACKLIST_MAX_HELD bytes are held
+ * back already. A mapping is replaced by remapMemory() instead.
+ *
+ * @param   size number of bytes to allocate
+ * @param   zero if not 0 the memory is set to zero
+ * @return  allocated memory or NULL
+ */
+static void *allocateMemory(size_t size, int zero) {
+  void *address = obtainMemory(size, zero);
+  if (address != NULL && isLarge(size) && isBlacklisted((uintptr_t)address))
+    return remapMemory(address, size);
+  for (int tries = 0; address != NULL && tries < BLACKLIST_MAX_RETRIES &&
+                      isBlacklisted((uintptr_t)address) && canHoldMemory(size);
+       tries++) {
+    holdMemory(address, size);
+    uintptr_t pageEnd = (pageOf((uintptr_t)address) + 1)
+                        << BLACKLIST_PAGE_SHIFT;
+    if ((uintptr_t)address + size < pageEnd) {
+      size_t rest = pageEnd - ((uintptr_t)address + size);
+      void *filler = canHoldMemory(rest) ? malloc(rest) : NULL;
+      if (filler != NULL)
+        holdMemory(filler, rest);
+    }
+    address = obtainMemory(size, zero);
+  }
+  return address;
+}
+
+/**
+ * Resize memory from allocateMemory(), keeping its content. Memory that
+ * becomes large is moved to its own mapping. With zero-on-free, memory
+ * that isn't mapped is always moved, so the old memory can be cleared.
+ * @param   ptr the memory to resize
+ * @param   size current size of the memory
+ * @param   flags SLOT_MAPPED if it's a mapping
+ * @param   newSize number of bytes to allocate, more than size
+ * @return  the resized memory or NULL (ptr is still valid then)
+ */
+static void *reallocateMemory(void *ptr, size_t size, Flags flags,
+                              size_t newSize) {
+  if (flags & SLOT_MAPPED) {
+    void *newPtr = mremap(ptr, mappingSize(size), mappingSize(newSize),
+                          MREMAP_MAYMOVE);
+    return newPtr == MAP_FAILED ? NULL : newPtr;
+  }
+  /* realloc() would free the old memory as it is when moving it */
+  if (!isLarge(newSize) && !sgc->zeroOnFree)
+    return realloc(ptr, newSize);
+  void *newPtr = obtainMemory(newSize, 0);
+  if (newPtr == NULL)
+    return NULL;
+  memcpy(newPtr, ptr, size);
+  if (sgc->zeroOnFree)
+    memset(ptr, 0, size);
+  free(ptr);
+  return newPtr;
+}
+
+/**
+ * Read a small file.
+ * @param   path path of the file
+ * @param   buffer where to store the content, terminated by '\\0'
+ * @param   size size of buffer
+ * @return  number of bytes read or -1 on error
+ */
+static ssize_t readFile(const char *path, char *buffer, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buffer, size - 1);
+  close(fd);
+  buffer[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+/**
+ * Find how much memory the process may still use in its cgroup (v2). That's
+ * the lowest memory.max - memory.current of its cgroup and the cgroups
+ * above, minus CGROUP_HEADROOM_FRACTION of that memory.max (at most half of
+ * it) for memory that isn't managed.
+ * @return  the number of bytes or 0 if there is no limit
+ */
+static size_t detectCgroupLimit() {
+  char buffer[4096];
+  if (readFile("/proc/self/cgroup", buffer, sizeof(buffer)) <= 0)
+    return 0;
+  /* the cgroup v2 entry looks like "0::/path" */
+  char *entry = strstr(buffer, "0::");
+  if (entry == NULL || (entry != buffer && entry[-1] != '\n'))
+    return 0;
+  char path[4096] = "/sys/fs/cgroup";
+  size_t length = strlen(path);
+  for (char *c = entry + 3; *c != '\n' && *c != '\0'; c++) {
+    if (length + 1 < sizeof(path) - sizeof("/memory.current"))
+      path[length++] = *c;
+  }
+  path[length] = '\0';
+
+  size_t limit = 0;
+  int limited = 0;
+  while (1) {
+    char value[64];
+    size_t end = strlen(path);
+    strcpy(path + end, "/memory.max");
+    if (readFile(path, value, sizeof(value)) > 0 && value[0] >= '0' &&
+        value[0] <= '9') { /* "max" means no limit */
+      size_t max = strtoull(value, NULL, 10);
+      strcpy(path + end, "/memory.current");
+      size_t current = readFile(path, value, sizeof(value)) > 0
+                           ? strtoull(value, NULL, 10)
+                           : 0;
+      size_t left = max > current ? max - current : 0;
+      /* keep at least half of what's left for managed memory */
+      size_t headroom = max * CGROUP_HEADROOM_FRACTION;
+      if (headroom > left / 2)
+        headroom = left / 2;
+      size_t available = left - headroom;
+      if (!limited || available < limit)
+        limit = available;
+      limited = 1;
+    }
+    path[end] = '\0';
+    /* continue with the parent cgroup */
+    char *slash = strrchr(path, '/');
+    if (slash == NULL || slash - path < (long)strlen("/sys/fs/cgroup"))
+      break;
+    *slash = '\0';
+  }
+  /* nothing left, 0 would mean no limit at all */
+  if (limited && limit == 0)
+    limit = 1;
+  return limit;
+}
+
+/**
+ * Buffered writer for sgc_dump_heap(), the marking child and allocation
+ * traces.
+ */
+typedef struct SGC_Writer_ {
+  int fd;                /**< file descriptor to write to */
+  int failed;            /**< set if a write() failed */
+  size_t count;          /**< number of bytes in buffer */
+  uint8_t buffer[4096];  /**< bytes not written yet */
+} Writer;
+
+/**
+ * Write the buffered bytes to the file descriptor.
+ * @param   writer writer to flush
+ */
+static void flushWriter(Writer *writer) {
+  size_t written = 0;
+  while (!writer->failed && written < writer->count) {
+    ssize_t n = write(writer->fd, writer->buffer + written,
+                      writer->count - written);
+    if (n < 0)
+      writer->failed = 1;
+    else
+      written += n;
+  }
+  writer->count = 0;
+}
+
+/**
+ * Write bytes to the buffer of writer, flushing it if necessary.
+ */
+static void writeBytes(Writer *writer, const void *bytes, size_t count) {
+  const uint8_t *b = bytes;
+  for (size_t i = 0; i < count; i++) {
+    if (writer->count == sizeof(writer->buffer))
+      flushWriter(writer);
+    writer->buffer[writer->count++] = b[i];
+  }
+}
+
+/**
+ * Write value as unsigned LEB128 (7 bits per byte, high bit set if more
+ * bytes follow).
+ */
+static void writeVarint(Writer *writer, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0)
+      byte |= 0x80;
+    writeBytes(writer, &byte, 1);
+  } while (value != 0);
+}
+
+/**
+ * Create a writer for fd.
+ * @return  the writer or NULL if out of memory
+ */
+static Writer *newWriter(int fd) {
+  Writer *writer = malloc(sizeof(Writer));
+  if (writer == NULL)
+    return NULL;
+  writer->fd = fd;
+  writer->failed = 0;
+  writer->count = 0;
+  return writer;
+}
+
+/**
+ * Append an event to the allocation trace, if one is recorded.
+ * @param   tag type of the event
+ * @param   values numbers belonging to the event
+ * @param   count number of values
+ */
+static void recordEvent(char tag, const uint64_t *values, int count) {
+  if (sgc->trace == NULL)
+    return;
+  writeBytes(sgc->trace, &tag, 1);
+  for (int i = 0; i < count; i++) {
+    writeVarint(sgc->trace, values[i]);
+  }
+}
+
 void sgc_init_(void *stackBottom) {
   sgc = malloc(sizeof(SGC));
   sgc->stackBottom = stackBottom;
+  sgc->stacks = NULL;
+  sgc->activeStack = NULL;
+  sgc->mainStackTop = NULL;
   sgc->minAddress = UINTPTR_MAX;
   sgc->maxAddress = 0;
 
   sgc->bytesAllocated = 0;
   sgc->nextGC = 1024;
+  sgc->softLimit = 0;
+  sgc->hardLimit = 0;
 
   sgc->slots = NULL;
   sgc->slotsCount = 0;
@@ -221,6 +718,47 @@ void sgc_init_(void *stackBottom) {
   sgc->grayCapacity = 0;
   sgc->grayList = NULL;
 
+  sgc->blacklistCount = 0;
+  sgc->blacklistCapacity = 0;
+  sgc->blacklist = NULL;
+
+  sgc->heldCount = 0;
+  sgc->heldCapacity = 0;
+  sgc->heldList = NULL;
+
+  sgc->stats = (SGC_Stats){0};
+
+  sgc->region = NULL;
+  sgc->zeroOnFree = 0;
+
+  sgc->trace = NULL;
+  sgc->traceSource = NULL;
+  sgc->traceReferences = 0;
+  sgc->findingRoots = 0;
+
+  sgc->mode = SGC_MODE_STOP_THE_WORLD;
+  sgc->markPid = 0;
+  sgc->markPipe = -1;
+  sgc->markCount = 0;
+  sgc->markCapacity = 0;
+  sgc->markBuffer = NULL;
+  sgc->markPollCounter = 0;
+
+  sgc->markThreadRunning = 0;
+  sgc->markThreadDone = 0;
+  sgc->markStackTop = NULL;
+  sgc->markStack = NULL;
+  pthread_mutex_init(&sgc->lock, NULL);
+
+  size_t cgroupLimit = detectCgroupLimit();
+  if (cgroupLimit != 0)
+    sgc_set_heap_limit(0, cgroupLimit);
+
+#ifdef SGC_PROFILE
+  sgc->sampleRate = PROFILE_SAMPLE_RATE;
+  sgc->sampleCounter = PROFILE_SAMPLE_RATE;
+#endif
+
 #ifdef SGC_DEBUG
   sgc->lastId = 0;
 
@@ -244,7 +782,12 @@ static void freeSlotAndMemory(SGC_Slot *slot, int freeMemory) {
 #ifdef SGC_DEBUG
     printf("   - free #%d\n", slot->id);
 #endif
-    free((void *)slot->address);
+    uint64_t values[] = {slot->address};
+    recordEvent('F', values, 1);
+    /* a mapping is zero filled again when it's reused */
+    if (sgc->zeroOnFree && !(slot->flags & SLOT_MAPPED))
+      memset((void *)slot->address, 0, slot->size);
+    releaseMemory((void *)slot->address, slot->size, slot->flags);
   }
 #ifdef SGC_DEBUG
   else {
@@ -271,16 +814,46 @@ void sgc_exit() {
 #ifdef SGC_DEBUG
   printf("-- start cleaning up\n");
 #endif
+  sgc_trace_stop();
+  /* the result of a marking child isn't needed anymore */
+  if (sgc->markPid != 0) {
+    kill(sgc->markPid, SIGKILL);
+    waitpid(sgc->markPid, NULL, 0);
+    close(sgc->markPipe);
+  }
+  free(sgc->markBuffer);
+  if (sgc->markThreadRunning) {
+    pthread_join(sgc->markThread, NULL);
+    sgc->markThreadRunning = 0;
+  }
+  pthread_mutex_destroy(&sgc->lock);
   /* free all used slots */
+  sgc->zeroOnFree = 0;
   for (int i = 0; i < sgc->slotsCapacity; i++) {
     SGC_Slot *slot = &sgc->slots[i];
     if (slot->flags & SLOT_IN_USE)
       freeSlot(slot);
   }
+  /* free active regions */
+  while (sgc->region != NULL)
+    sgc_region_end();
+  /* free registered stacks */
+  while (sgc->stacks != NULL) {
+    SGC_Stack *stack = sgc->stacks;
+    sgc->stacks = stack->next;
+    free(stack);
+  }
   /* free slots list */
   free(sgc->slots);
   /* free gray list */
   free(sgc->grayList);
+  /* free held back memory and blacklist */
+  for (int i = 0; i < sgc->heldCount; i++) {
+    SGC_Held *held = &sgc->heldList[i];
+    free((void *)held->address);
+  }
+  free(sgc->heldList);
+  free(sgc->blacklist);
   /* free main struct */
   free(sgc);
 #ifdef SGC_DEBUG
@@ -293,16 +866,125 @@ void sgc_exit() {
 #endif
 }
 
+static void startMarking();
+static void pollMarking(int wait);
+static void startMarkThread();
+static void pollMarkThread(int wait);
+
+/**
+ * Lock the SGC struct if a concurrent marker thread is running.
+ * The flag is only changed by the thread that allocates, so it's safe to
+ * check without the lock.
+ */
+static void lock() {
+  if (sgc->markThreadRunning)
+    pthread_mutex_lock(&sgc->lock);
+}
+
+/**
+ * Unlock the SGC struct if a concurrent marker thread is running.
+ */
+static void unlock() {
+  if (sgc->markThreadRunning)
+    pthread_mutex_unlock(&sgc->lock);
+}
+
+/**
+ * Set the amount of memory at which the next collection is triggered.
+ *
+ * Usually it's HEAP_GROW_FACTOR times the memory in use. It's never above
+ * the soft limit, and above the soft limit a collection is triggered when
+ * 1 / HEAP_GROW_FACTOR of the remaining memory up to the hard limit is used.
+ */
+static void updateNextGC() {
+  size_t next = sgc->bytesAllocated * HEAP_GROW_FACTOR;
+  if (sgc->softLimit != 0 && next > sgc->softLimit) {
+    if (sgc->bytesAllocated < sgc->softLimit) {
+      next = sgc->softLimit;
+    } else {
+      size_t headroom = sgc->hardLimit > sgc->bytesAllocated
+                            ? sgc->hardLimit - sgc->bytesAllocated
+                            : 0;
+      next = sgc->bytesAllocated + headroom / HEAP_GROW_FACTOR;
+    }
+  }
+  sgc->nextGC = next;
+}
+
+void sgc_set_heap_limit(size_t softLimit, size_t hardLimit) {
+  lock();
+  sgc->hardLimit = hardLimit;
+  if (hardLimit == 0)
+    sgc->softLimit = 0;
+  else if (softLimit == 0 || softLimit > hardLimit)
+    sgc->softLimit = hardLimit * SOFT_LIMIT_FRACTION;
+  else
+    sgc->softLimit = softLimit;
+  updateNextGC();
+  unlock();
+#ifdef SGC_DEBUG
+  printf("-- heap limits: soft %lu, hard %lu\n", sgc->softLimit,
+         sgc->hardLimit);
+#endif
+}
+
+/**
+ * Check if allocating size more bytes would exceed the hard limit.
+ * Held back memory and region chunks aren't managed, but they are memory
+ * of the process as well.
+ */
+static int exceedsHardLimit(size_t size) {
+  return sgc->hardLimit != 0 &&
+         sgc->bytesAllocated + sgc->stats.blacklistedBytes +
+                 sgc->stats.regionBytes + size >
+             sgc->hardLimit;
+}
+
+/**
+ * Collect because an allocation failed, in hope it works afterwards.
+ * Avoiding blacklisted pages isn't worth failing, so all held back memory
+ * is released as well.
+ */
+static void emergencyCollect() {
+#ifdef SGC_DEBUG
+  printf("-- emergency collection\n");
+#endif
+  sgc->stats.emergencyCollections++;
+  sgc_collect();
+  releaseHeldMemory(1);
+}
+
 /**
  * Check if a collection should be done and run it if so.
+ * If a forked child is marking, check if it's done instead.
  */
 static void collectIfNecessary() {
 #ifdef SGC_STRESS
   sgc_collect();
 #else
-  /* if enough memory was allocated in total start a collection */
-  if (sgc->bytesAllocated > sgc->nextGC) {
-    sgc_collect();
+  if (sgc->markPid != 0) {
+    /* reading the pipe is a system call, so only do it now and then */
+    if (++sgc->markPollCounter >= MARK_POLL_INTERVAL) {
+      sgc->markPollCounter = 0;
+      pollMarking(0);
+    }
+    return;
+  }
+  if (sgc->markThreadRunning) {
+    pollMarkThread(0);
+    return;
+  }
+  /* if enough memory was allocated in total start a collection, held back
+   * memory only goes away with one */
+  if (sgc->bytesAllocated + sgc->stats.blacklistedBytes > sgc->nextGC) {
+    if (sgc->trace != NULL)
+      sgc_collect(); /* references are only recorded by this one */
+    else if (sgc->mode == SGC_MODE_FORK)
+      startMarking();
+    else if (sgc->mode == SGC_MODE_SOFT_DIRTY)
+      startMarkThread();
+    else
+      sgc_collect();
   }
 #endif
 }
@@ -327,88 +1009,403 @@ static void updateMemoryAddressRange(const SGC_Slot *slot) {
 }
 
 /**
- * Allocate managed memory.
- *
- * Find a slot for storing information about the memory,
- * allocate memory at the heap and store it's adress and size.
- * Start collection if a decent amount of memory was allocated.
+ * Remember the allocation site for slot, if this allocation is sampled.
+ * Does nothing without SGC_PROFILE.
+ * @param   slot the slot of the new allocation
+ * @param   file source file of the allocation
+ * @param   line source line of the allocation
  */
-void *sgc_malloc(size_t size) {
-  /* allocate requested amount of memory */
-  void *address = malloc(size);
-  if (address == NULL)
-    return NULL;
+static void recordSite(SGC_Slot *slot, const char *file, int line) {
+#ifdef SGC_PROFILE
+  if (file == NULL || --sgc->sampleCounter > 0)
+    return;
+  sgc->sampleCounter = sgc->sampleRate;
+  slot->file = file;
+  slot->line = line;
+#else
+  (void)slot;
+  (void)file;
+  (void)line;
+#endif
+}
 
-  /* trigger the collection */
-  collectIfNecessary();
+#ifdef SGC_PROFILE
+void sgc_set_sample_rate(unsigned rate) {
+  sgc->sampleRate = rate > 0 ? rate : 1;
+  sgc->sampleCounter = sgc->sampleRate;
+}
+#endif
 
-  /* store information about the memory */
-  SGC_Slot *slot = getSlot((uintptr_t)address);
-  slot->size = size;
-  slot->address = (uintptr_t)address;
-  slot->flags = SLOT_IN_USE;
+/**
+ * Get the flags for the slot of a new allocation.
+ * A forked child doesn't know about the allocation, so it must not be freed
+ * when the child's result arrives. A concurrent marker thread must not free
+ * it either, so it's marked already.
+ * @param   size size of the allocation
+ */
+static Flags newSlotFlags(size_t size) {
+  Flags flags = isLarge(size) ? SLOT_IN_USE | SLOT_MAPPED : SLOT_IN_USE;
+  if (sgc->markPid != 0)
+    flags |= SLOT_NEW;
+  if (sgc->markThreadRunning)
+    flags |= SLOT_MARKED;
+  return flags;
+}
 
-#ifdef SGC_DEBUG
-  printf("-- allocated %lu bytes for #%d\n", size, slot->id);
-#endif
-  /* add size to total amout of allocated memory, for triggering
-   * the next collection */
-  sgc->bytesAllocated += size;
+/**
+ * Get the memory of the allocations of a region chunk.
+ */
+static uint8_t *chunkData(SGC_RegionChunk *chunk) {
+  return (uint8_t *)(chunk + 1);
+}
 
-  /* update the lower and upper memory address bounds */
-  updateMemoryAddressRange(slot);
+/**
+ * Check if size can't be allocated in a region, because rounding it up or
+ * adding the size and chunk headers would overflow.
+ */
+static int isTooLargeForRegion(size_t size) {
+  return size > SIZE_MAX - 2 * REGION_ALIGNMENT - sizeof(SGC_RegionChunk);
+}
 
-  return address;
+/**
+ * Get the size of an allocation in a region. It's stored in the
+ * REGION_ALIGNMENT bytes before the allocation.
+ */
+static size_t *regionSize(void *ptr) {
+  return (size_t *)((uint8_t *)ptr - REGION_ALIGNMENT);
 }
 
 /**
- * Get
+ * Allocate memory in a region. A new chunk counts against the hard limit
+ * like managed memory.
+ * @param   region the region to allocate in
+ * @param   size number of bytes to allocate
+ * @return  pointer to the allocated memory or NULL
  */
-void *sgc_realloc(void *ptr, size_t newSize) {
-  /* if ptr is NULL it's a normal allocation */
-  if (ptr == NULL) {
-    return sgc_malloc(newSize);
+static void *regionAllocate(SGC_Region *region, size_t size) {
+  SGC_RegionChunk *chunk = region->chunks;
+  if (isTooLargeForRegion(size))
+    return NULL;
+  /* round up, so every allocation is aligned, and add the size header */
+  size_t space = ((size + REGION_ALIGNMENT - 1) &
+                  ~(size_t)(REGION_ALIGNMENT - 1)) +
+                 REGION_ALIGNMENT;
+
+  if (chunk == NULL || chunk->capacity - chunk->used < space) {
+    size_t capacity = space > REGION_CHUNK_SIZE ? space : REGION_CHUNK_SIZE;
+    if (exceedsHardLimit(sizeof(SGC_RegionChunk) + capacity))
+      return NULL;
+    chunk = malloc(sizeof(SGC_RegionChunk) + capacity);
+    if (chunk == NULL)
+      return NULL;
+    sgc->stats.regionBytes += sizeof(SGC_RegionChunk) + capacity;
+    chunk->next = region->chunks;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    chunk->last = 0;
+    region->chunks = chunk;
+#ifdef SGC_DEBUG
+    printf("-- new region chunk of %lu bytes\n", capacity);
+#endif
   }
 
-  /* get the slot for the memory address */
-  SGC_Slot *slot = findSlot((uintptr_t)ptr);
+  chunk->last = chunk->used;
+  chunk->used += space;
+  void *ptr = chunkData(chunk) + chunk->last + REGION_ALIGNMENT;
+  *regionSize(ptr) = size;
+  return ptr;
+}
 
-  /* if the slot is not in use do a normal allocation */
-  if (slot == NULL || !(slot->flags & SLOT_IN_USE)) {
-    return sgc_malloc(newSize);
+/**
+ * Find the region chunk ptr was allocated in.
+ * @param   ptr pointer to check
+ * @param   owner if not NULL, set to the region of the chunk
+ * @return  the chunk or NULL if ptr is not in an active region
+ */
+static SGC_RegionChunk *findRegionChunk(void *ptr, SGC_Region **owner) {
+  for (SGC_Region *region = sgc->region; region != NULL;
+       region = region->parent) {
+    for (SGC_RegionChunk *chunk = region->chunks; chunk != NULL;
+         chunk = chunk->next) {
+      uint8_t *data = chunkData(chunk);
+      /* an allocation of 0 bytes ends at the end of the chunk */
+      if ((uint8_t *)ptr > data && (uint8_t *)ptr <= data + chunk->used) {
+        if (owner != NULL)
+          *owner = region;
+        return chunk;
+      }
+    }
   }
+  return NULL;
+}
 
-  /* if new size is less than old size do nothing */
-  if (slot->size >= newSize) {
+/**
+ * Reallocate memory of a region. Does nothing if it's large enough
+ * already. Grow it in place if it's the last allocation of the current
+ * chunk, otherwise copy it to a new allocation in the same region.
+ * @param   region the region ptr was allocated in
+ * @param   chunk the chunk ptr was allocated in
+ * @param   ptr the pointer to reallocate
+ * @param   newSize number of bytes to allocate
+ * @return  pointer to the allocated memory or NULL
+ */
+static void *regionReallocate(SGC_Region *region, SGC_RegionChunk *chunk,
+                              void *ptr, size_t newSize) {
+  size_t oldSize = *regionSize(ptr);
+  if (newSize <= oldSize)
+    return ptr;
+  if (isTooLargeForRegion(newSize))
+    return NULL;
+  size_t offset = (uint8_t *)ptr - REGION_ALIGNMENT - chunkData(chunk);
+  size_t size = ((newSize + REGION_ALIGNMENT - 1) &
+                 ~(size_t)(REGION_ALIGNMENT - 1)) +
+                REGION_ALIGNMENT;
+
+  if (chunk == region->chunks && offset == chunk->last &&
+      chunk->capacity - offset >= size) {
+    chunk->used = offset + size;
+    *regionSize(ptr) = newSize;
     return ptr;
   }
 
-  /* trigger collection */
-  collectIfNecessary();
-
-  /* real reallocation */
-  void *newPtr = realloc(ptr, newSize);
-
-  /* if the pointer didn't change just adjust the slot size */
-  if (newPtr == ptr) {
-    sgc->bytesAllocated += newSize - slot->size;
+  void *newPtr = regionAllocate(region, newSize);
+  if (newPtr != NULL)
+    memcpy(newPtr, ptr, oldSize);
+  return newPtr;
+}
 
+void sgc_region_begin() {
+  SGC_Region *region = malloc(sizeof(SGC_Region));
+  if (region == NULL)
+    exit(1);
+  lock();
+  region->parent = sgc->region;
+  region->chunks = NULL;
+  sgc->region = region;
+  unlock();
 #ifdef SGC_DEBUG
-    printf("-- reallocated %lu bytes (before %lu bytes) for #%d\n", newSize,
-           slot->size, slot->id);
+  printf("-- begin region\n");
 #endif
-    slot->size = newSize;
-
-    updateMemoryAddressRange(slot);
+}
 
-    return ptr;
+void sgc_region_end() {
+  lock();
+  SGC_Region *region = sgc->region;
+  if (region == NULL) {
+    unlock();
+    return;
+  }
+  sgc->region = region->parent;
+  unlock();
+
+  size_t freed = 0;
+  while (region->chunks != NULL) {
+    SGC_RegionChunk *chunk = region->chunks;
+    region->chunks = chunk->next;
+    freed += sizeof(SGC_RegionChunk) + chunk->capacity;
+    if (sgc->zeroOnFree)
+      memset(chunkData(chunk), 0, chunk->used);
+    free(chunk);
+  }
+  free(region);
+  lock();
+  sgc->stats.regionBytes -= freed;
+  unlock();
+#ifdef SGC_DEBUG
+  printf("-- end region\n");
+#endif
+}
+
+void sgc_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  lock();
+  SGC_RegionChunk *chunk = findRegionChunk(ptr, NULL);
+  if (chunk != NULL) {
+    /* only the last allocation can be given back to a chunk */
+    size_t offset = (uint8_t *)ptr - REGION_ALIGNMENT - chunkData(chunk);
+    if (offset == chunk->last && chunk->used > offset) {
+      /* the rest of the chunk isn't cleared by sgc_region_end() */
+      if (sgc->zeroOnFree)
+        memset(chunkData(chunk) + offset, 0, chunk->used - offset);
+      chunk->used = offset;
+    }
+  } else {
+    SGC_Slot *slot = findSlot((uintptr_t)ptr);
+    if (slot != NULL && (slot->flags & SLOT_IN_USE))
+      freeSlot(slot);
+  }
+  unlock();
+}
+
+/**
+ * Allocate managed memory.
+ *
+ * Find a slot for storing information about the memory,
+ * allocate memory at the heap and store it's adress and size.
+ * Start collection if a decent amount of memory was allocated.
+ * @param   size number of bytes to allocate
+ * @param   descriptor where the pointers are, NULL if unknown
+ * @param   zero if not 0 the memory is set to zero
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+static void *allocate(size_t size, const SGC_Descriptor *descriptor,
+                      int zero, const char *file, int line) {
+  /* allocations in a region don't involve the collector */
+  if (sgc->region != NULL) {
+    lock();
+    void *address = regionAllocate(sgc->region, size);
+    unlock();
+    if (address == NULL) {
+      emergencyCollect();
+      lock();
+      address = regionAllocate(sgc->region, size);
+      unlock();
+    }
+    if (address != NULL && zero)
+      memset(address, 0, size);
+    return address;
+  }
+
+  /* trigger the collection first, so freed memory can be reused */
+  collectIfNecessary();
+
+  /* allocate requested amount of memory */
+  lock();
+  void *address = exceedsHardLimit(size) ? NULL : allocateMemory(size, zero);
+  unlock();
+  if (address == NULL) {
+    /* collect everything possible and try again */
+    emergencyCollect();
+    lock();
+    address = exceedsHardLimit(size) ? NULL : allocateMemory(size, zero);
+    unlock();
+    if (address == NULL)
+      return NULL;
   }
 
+  lock();
+  /* store information about the memory */
+  SGC_Slot *slot = getSlot((uintptr_t)address);
+  slot->size = size;
+  slot->address = (uintptr_t)address;
+  slot->flags = newSlotFlags(size);
+  slot->descriptor = descriptor;
+  recordSite(slot, file, line);
+
+#ifdef SGC_DEBUG
+  printf("-- allocated %lu bytes for #%d\n", size, slot->id);
+#endif
+  uint64_t values[] = {slot->address, size};
+  recordEvent('M', values, 2);
+  /* add size to total amout of allocated memory, for triggering
+   * the next collection */
+  sgc->bytesAllocated += size;
+
+  /* update the lower and upper memory address bounds */
+  updateMemoryAddressRange(slot);
+  unlock();
+
+  return address;
+}
+
+void *sgc_malloc(size_t size) { return allocate(size, NULL, 0, NULL, 0); }
+
+void *sgc_malloc_typed(size_t size, const SGC_Descriptor *descriptor) {
+  return allocate(size, descriptor, 0, NULL, 0);
+}
+
+void *sgc_malloc_at(size_t size, const char *file, int line) {
+  return allocate(size, NULL, 0, file, line);
+}
+
+void *sgc_malloc_typed_at(size_t size, const SGC_Descriptor *descriptor,
+                          const char *file, int line) {
+  return allocate(size, descriptor, 0, file, line);
+}
+
+void *sgc_calloc(size_t count, size_t size) {
+  return sgc_calloc_at(count, size, NULL, 0);
+}
+
+void *sgc_calloc_at(size_t count, size_t size, const char *file, int line) {
+  if (size != 0 && count > SIZE_MAX / size)
+    return NULL;
+  return allocate(count * size, NULL, 1, file, line);
+}
+
+void sgc_set_zero_on_free(int enabled) {
+  lock();
+  sgc->zeroOnFree = enabled;
+  unlock();
+}
+
+/**
+ * Reallocate the memory of slot and update the slot table.
+ * @param   slot slot of ptr
+ * @param   ptr the pointer to reallocate
+ * @param   newSize number of bytes to allocate, more than the current size
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+static void *reallocateSlot(SGC_Slot *slot, void *ptr, size_t newSize,
+                            const char *file, int line) {
+  /* real reallocation */
+  uintptr_t oldAddress = (uintptr_t)ptr;
+  void *newPtr = reallocateMemory(ptr, slot->size, slot->flags, newSize);
+  if (newPtr == NULL)
+    return NULL;
+  uint64_t values[] = {oldAddress, (uintptr_t)newPtr, newSize};
+  recordEvent('R', values, 3);
+
+  /* if the pointer didn't change just adjust the slot size */
+  if (newPtr == ptr) {
+    sgc->bytesAllocated += newSize - slot->size;
+
+#ifdef SGC_DEBUG
+    printf("-- reallocated %lu bytes (before %lu bytes) for #%d\n", newSize,
+           slot->size, slot->id);
+#endif
+    slot->size = newSize;
+#ifdef SGC_PROFILE
+    if (slot->file == NULL)
+      recordSite(slot, file, line);
+#endif
+
+    updateMemoryAddressRange(slot);
+
+    return ptr;
+  }
+
+  const SGC_Descriptor *descriptor = slot->descriptor;
+#ifdef SGC_PROFILE
+  const char *oldFile = slot->file;
+  int oldLine = slot->line;
+#endif
+
   /* store information about the memory */
   SGC_Slot *newSlot = getSlot((uintptr_t)newPtr);
   newSlot->size = newSize;
   newSlot->address = (uintptr_t)newPtr;
-  newSlot->flags = SLOT_IN_USE;
+  newSlot->flags = newSlotFlags(newSize);
+  newSlot->descriptor = descriptor;
+#ifdef SGC_PROFILE
+  if (oldFile != NULL) {
+    newSlot->file = oldFile;
+    newSlot->line = oldLine;
+  } else {
+    recordSite(newSlot, file, line);
+  }
+#else
+  (void)file;
+  (void)line;
+#endif
+
+  /* getSlot() might have grown the hash table, so find the old slot again */
+  slot = findSlot((uintptr_t)ptr);
 
   /* adjust the amount of allocated memory */
   sgc->bytesAllocated += newSize;
@@ -427,6 +1424,76 @@ void *sgc_realloc(void *ptr, size_t newSize) {
   return newPtr;
 }
 
+void *sgc_realloc(void *ptr, size_t newSize) {
+  return sgc_realloc_at(ptr, newSize, NULL, 0);
+}
+
+/**
+ * Reallocate managed memory.
+ *
+ * The new allocation keeps the allocation site of the old one. If that
+ * wasn't sampled, the site of the reallocation may be recorded.
+ */
+void *sgc_realloc_at(void *ptr, size_t newSize, const char *file, int line) {
+  /* if ptr is NULL it's a normal allocation */
+  if (ptr == NULL) {
+    return sgc_malloc_at(newSize, file, line);
+  }
+
+  /* memory of a region stays in a region */
+  lock();
+  SGC_Region *region;
+  SGC_RegionChunk *chunk = findRegionChunk(ptr, &region);
+  if (chunk != NULL) {
+    void *newPtr = regionReallocate(region, chunk, ptr, newSize);
+    unlock();
+    if (newPtr == NULL) {
+      emergencyCollect();
+      lock();
+      newPtr = regionReallocate(region, chunk, ptr, newSize);
+      unlock();
+    }
+    return newPtr;
+  }
+
+  /* get the slot for the memory address */
+  SGC_Slot *slot = findSlot((uintptr_t)ptr);
+  int managed = slot != NULL && (slot->flags & SLOT_IN_USE);
+  size_t size = managed ? slot->size : 0;
+  unlock();
+
+  /* if the slot is not in use do a normal allocation */
+  if (!managed) {
+    return sgc_malloc_at(newSize, file, line);
+  }
+
+  /* if new size is less than old size do nothing */
+  if (size >= newSize) {
+    return ptr;
+  }
+
+  /* trigger collection */
+  collectIfNecessary();
+
+  lock();
+  void *newPtr = exceedsHardLimit(newSize - size)
+                     ? NULL
+                     : reallocateSlot(findSlot((uintptr_t)ptr), ptr, newSize,
+                                      file, line);
+  unlock();
+  if (newPtr == NULL) {
+    /* collect everything possible and try again, ptr is still valid */
+    emergencyCollect();
+    lock();
+    newPtr = exceedsHardLimit(newSize - size)
+                 ? NULL
+                 : reallocateSlot(findSlot((uintptr_t)ptr), ptr, newSize,
+                                  file, line);
+    unlock();
+  }
+  return newPtr;
+}
+
 /**
  * Mark slot as reachable, and finished (black in tricolor abstraction)
  * @param   slot to mark
@@ -438,6 +1505,36 @@ static void markSlot(SGC_Slot *slot) {
 #endif
 }
 
+/**
+ * Get the slot managing address.
+ * @param   address memory address
+ * @return  the slot or NULL if address is not managed
+ */
+static SGC_Slot *findManagedSlot(uintptr_t address) {
+  if (sgc->slotsCount == 0 || address < sgc->minAddress ||
+      address > sgc->maxAddress)
+    return NULL;
+  SGC_Slot *slot = findSlot(address);
+  return slot->flags & SLOT_IN_USE ? slot : NULL;
+}
+
+/**
+ * Record a reference found during a collection in the allocation trace.
+ * @param   ptr where the reference was found
+ * @param   slot the referenced slot
+ */
+static void recordReference(void **ptr, const SGC_Slot *slot) {
+  if (sgc->traceSource == NULL) {
+    uint64_t values[] = {slot->address};
+    recordEvent('r', values, 1);
+  } else {
+    uint64_t values[] = {sgc->traceSource->address,
+                         (uintptr_t)ptr - sgc->traceSource->address,
+                         slot->address};
+    recordEvent('e', values, 3);
+  }
+}
+
 /**
  * Check if there is a pointer at the given address, and if it is managed
  * by a SGC_Slot. If so mark slot as reachable.
@@ -449,14 +1546,24 @@ static void checkAddress(void **ptr) {
   /* check if the value (interpreted as a memory address) is in the range of
    * managed addresses */
   uintptr_t address = (uintptr_t)*ptr;
-  if (ptr == NULL || address < sgc->minAddress || address > sgc->maxAddress)
+  if (ptr == NULL || address < sgc->minAddress || address > sgc->maxAddress) {
+    /* values close to the managed range might hit future allocations */
+    if (address >= sgc->minAddress - BLACKLIST_NEAR &&
+        address <= sgc->maxAddress + BLACKLIST_NEAR && !sgc->findingRoots)
+      blacklistAddress(address);
     return;
+  }
 
   /* check if the address is managed */
   SGC_Slot *slot = findSlot(address);
   if (slot->flags & SLOT_IN_USE) {
     /* if address is managed put slot on gray list */
     markGray(slot);
+    if (sgc->traceReferences)
+      recordReference(ptr, slot);
+  } else if (!sgc->findingRoots) {
+    /* otherwise it's a false pointer */
+    blacklistAddress(address);
   }
 }
 
@@ -498,25 +1605,182 @@ static void scanRegion(void *begin, void *end) {
   }
 }
 
+/**
+ * Check if address is within the memory of a registered stack.
+ */
+static int isOnStack(const SGC_Stack *stack, void *address) {
+  return address >= stack->begin && address <= stack->bottom;
+}
+
+/**
+ * Find the stack top is on. Usually it's the active stack, but a coroutine
+ * that ended through uc_link left its stack without sgc_stack_switch().
+ * Then it's the registered stack top is within, or the main stack.
+ * @param   top the current top of the stack in use
+ * @return  the stack or NULL for the main stack
+ */
+static SGC_Stack *currentStack(void *top) {
+  if (sgc->activeStack == NULL || isOnStack(sgc->activeStack, top))
+    return sgc->activeStack;
+  for (SGC_Stack *stack = sgc->stacks; stack != NULL; stack = stack->next) {
+    if (isOnStack(stack, top))
+      return stack;
+  }
+  return NULL;
+}
+
+/**
+ * Scan the main stack and all registered stacks.
+ * @param   active the stack in use (NULL for the main stack)
+ * @param   top the current top of the stack in use
+ */
+static void scanStacks(SGC_Stack *active, void *top) {
+  if (active == NULL) {
+    scanRegion(sgc->stackBottom, top);
+  } else {
+    scanRegion(active->bottom, top);
+    if (sgc->mainStackTop != NULL)
+      scanRegion(sgc->stackBottom, sgc->mainStackTop);
+  }
+  /* only the used part of left stacks */
+  for (SGC_Stack *stack = sgc->stacks; stack != NULL; stack = stack->next) {
+    if (stack != active && stack->top != NULL && isOnStack(stack, stack->top))
+      scanRegion(stack->bottom, stack->top);
+  }
+}
+
 /**
  * Scan stack.
  */
-void scanStack() { scanRegion(sgc->stackBottom, getStackTop()); }
+void scanStack() {
+  void *top = getStackTop();
+  scanStacks(currentStack(top), top);
+}
+
+SGC_Stack *sgc_stack_register(void *begin, size_t size) {
+  SGC_Stack *stack = malloc(sizeof(SGC_Stack));
+  if (stack == NULL)
+    return NULL;
+  stack->begin = begin;
+  /* the bottom is the last aligned word within the memory, it's scanned */
+  stack->bottom = (void *)(((uintptr_t)begin + size - sizeof(void *)) &
+                           ~(uintptr_t)(sizeof(void *) - 1));
+  stack->top = NULL;
+  lock();
+  stack->next = sgc->stacks;
+  sgc->stacks = stack;
+  unlock();
+  return stack;
+}
+
+void sgc_stack_unregister(SGC_Stack *stack) {
+  lock();
+  for (SGC_Stack **s = &sgc->stacks; *s != NULL; s = &(*s)->next) {
+    if (*s == stack) {
+      *s = stack->next;
+      break;
+    }
+  }
+  /* the marker thread must not scan it anymore */
+  if (sgc->markStack == stack)
+    sgc->markStackTop = NULL;
+  /* it was left without sgc_stack_switch(), e.g. through uc_link */
+  if (sgc->activeStack == stack)
+    sgc->activeStack = NULL;
+  unlock();
+  free(stack);
+}
+
+void sgc_stack_switch(SGC_Stack *to) {
+  void *top = getStackTop();
+  lock();
+  SGC_Stack *current = currentStack(top);
+  /* a stack left without telling (a coroutine that ended) holds nothing */
+  if (sgc->activeStack != NULL && sgc->activeStack != current)
+    sgc->activeStack->top = NULL;
+  if (current == NULL)
+    sgc->mainStackTop = top;
+  else
+    current->top = top;
+  sgc->activeStack = to;
+  unlock();
+}
+
+/**
+ * Scan the memory of all active regions.
+ */
+static void scanRegionChunks() {
+  for (SGC_Region *region = sgc->region; region != NULL;
+       region = region->parent) {
+    for (SGC_RegionChunk *chunk = region->chunks; chunk != NULL;
+         chunk = chunk->next) {
+      scanRegion(chunkData(chunk), chunkData(chunk) + chunk->used);
+    }
+  }
+}
+
+/**
+ * Scan data segment, BSS, stack and regions. Put all slots referenced from
+ * there on the gray list.
+ */
+static void scanRoots() {
+  extern char end, etext;   /* provided by the linker */
+  scanRegion(&end, &etext); /* not sure why it only works correcty if end is
+                               provides as first parameter */
+
+  scanStack();
+  scanRegionChunks();
+}
+
+/**
+ * Layout of memory allocated without a descriptor: every word may be a
+ * pointer.
+ */
+static const size_t wordOffsets[] = {0};
+static const SGC_Descriptor wordDescriptor = {sizeof(void *), 1, wordOffsets};
+
+/**
+ * Scan the memory of slot for known pointers. Only the pointers of its
+ * descriptor are checked, every word if it has none.
+ */
+static void scanSlot(const SGC_Slot *slot) {
+  const SGC_Descriptor *descriptor =
+      slot->descriptor != NULL ? slot->descriptor : &wordDescriptor;
+  /* pointer-free memory, don't walk a huge buffer for nothing */
+  if (descriptor->count == 0)
+    return;
+  uintptr_t end = slot->address + slot->size;
+  for (uintptr_t element = slot->address; element + descriptor->size <= end;
+       element += descriptor->size) {
+    for (size_t i = 0; i < descriptor->count; i++) {
+      checkAddress((void **)(element + descriptor->offsets[i]));
+    }
+  }
+}
+
+/**
+ * Take one slot from the gray list and scan its memory.
+ */
+static void traceNext() {
+  /* get last element of grayList and remove it from list */
+  SGC_Slot *slot = sgc->grayList[--sgc->grayCount];
+  /* continue if it's already done or was freed meanwhile */
+  if (slot->flags & SLOT_MARKED || !(slot->flags & SLOT_IN_USE))
+    return;
+  /* scan memory managed by slot */
+  sgc->traceSource = slot;
+  scanSlot(slot);
+  sgc->traceSource = NULL;
+  /* mark slot as done (black in tricolor abstraction) */
+  markSlot(slot);
+}
 
 /**
  * Scan all memory regions of managed slots.
  */
 void trace() {
   while (sgc->grayCount > 0) {
-    /* get last element of grayList and remove it from list */
-    SGC_Slot *slot = sgc->grayList[--sgc->grayCount];
-    /* continue if it's already done */
-    if (slot->flags & SLOT_MARKED)
-      continue;
-    /* scan memory managed by slot */
-    scanRegion((void *)slot->address, (void *)(slot->address + slot->size));
-    /* mark slot as done (black in tricolor abstraction) */
-    markSlot(slot);
+    traceNext();
   }
 }
 
@@ -530,8 +1794,11 @@ void sweep() {
     /* ignore unused slots */
     if (slot->flags & SLOT_IN_USE) {
       /* unmark marked slots */
-      if (slot->flags & SLOT_MARKED)
+      if (slot->flags & SLOT_MARKED) {
         slot->flags ^= SLOT_MARKED;
+        if (isBlacklisted(slot->address))
+          sgc->stats.sharedPageBytes += slot->size;
+      }
       /* free unmarked slots */
       else
         freeSlot(slot);
@@ -543,20 +1810,44 @@ void sweep() {
  * scan, trace and sweep garbage.
  */
 void sgc_collect() {
+  /* finish a collection in progress first */
+  if (sgc->markPid != 0)
+    pollMarking(1);
+  if (sgc->markThreadRunning)
+    pollMarkThread(1);
+
 #ifdef SGC_DEBUG
   printf("-- begin collection\n");
   size_t before = sgc->bytesAllocated;
 #endif
-  extern char end, etext;   /* provided by the linker */
-  scanRegion(&end, &etext); /* not sure why it only works correcty if end is
-                               provides as first parameter */
+  /* the blacklist is rebuild from the false pointers found this time */
+  clearBlacklist();
+  sgc->stats.sharedPageBytes = 0;
+
+  struct timespec start;
+  if (sgc->trace != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    recordEvent('C', NULL, 0);
+    sgc->traceReferences = 1;
+  }
 
-  scanStack();
+  scanRoots();
   trace();
+  sgc->traceReferences = 0;
   sweep();
+  sgc->stats.collections++;
+  releaseHeldMemory(0);
 
   /* update amount of memory at which the next collection should be triggered */
-  sgc->nextGC = sgc->bytesAllocated * HEAP_GROW_FACTOR;
+  updateNextGC();
+
+  if (sgc->trace != NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t values[] = {(now.tv_sec - start.tv_sec) * 1000000000ull +
+                         now.tv_nsec - start.tv_nsec};
+    recordEvent('c', values, 1);
+  }
 
 #ifdef SGC_DEBUG
   printf("-- end collection\n");
@@ -565,3 +1856,574 @@ void sgc_collect() {
   printf("   next collection at %lu\n", sgc->nextGC);
 #endif
 }
+
+void sgc_get_stats(SGC_Stats *stats) {
+  lock();
+  *stats = sgc->stats;
+  stats->bytesAllocated = sgc->bytesAllocated;
+  stats->blacklistedPages = sgc->blacklistCount;
+  unlock();
+}
+
+/**
+ * Write the references found in the memory of slot. Only the number of
+ * references is known after scanning, so it is done twice.
+ */
+static void writeReferences(Writer *writer, const SGC_Slot *slot) {
+  const SGC_Descriptor *descriptor =
+      slot->descriptor != NULL ? slot->descriptor : &wordDescriptor;
+  if (descriptor->count == 0) {
+    writeVarint(writer, 0);
+    return;
+  }
+  uintptr_t end = slot->address + slot->size;
+  uint64_t count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      writeVarint(writer, count);
+    for (uintptr_t element = slot->address; element + descriptor->size <= end;
+         element += descriptor->size) {
+      for (size_t i = 0; i < descriptor->count; i++) {
+        uintptr_t value = *(uintptr_t *)(element + descriptor->offsets[i]);
+        if (findManagedSlot(value) == NULL)
+          continue;
+        if (pass == 0)
+          count++;
+        else
+          writeVarint(writer, value);
+      }
+    }
+  }
+}
+
+/**
+ * Format (all numbers are LEB128 varints):
+ *   "SGCH" version sampleRate
+ *   for every allocation:
+ *     'O' address size flags line fileLength file[fileLength]
+ *         referenceCount reference[referenceCount]
+ *   'E'
+ * flags is 1 if the allocation is referenced from a root. line and
+ * fileLength are 0 if the allocation site wasn't sampled. Every sampleRate-th
+ * allocation was sampled (1 without SGC_PROFILE).
+ */
+int sgc_dump_heap(int fd) {
+  sgc_collect();
+
+  /* find slots referenced from roots, the collection built the blacklist */
+  sgc->findingRoots = 1;
+  scanRoots();
+  sgc->findingRoots = 0;
+  while (sgc->grayCount > 0) {
+    sgc->grayList[--sgc->grayCount]->flags |= SLOT_ROOT;
+  }
+
+  Writer *writer = newWriter(fd);
+  if (writer == NULL)
+    return -1;
+
+  writeBytes(writer, "SGCH", 4);
+  writeVarint(writer, 2);
+#ifdef SGC_PROFILE
+  writeVarint(writer, sgc->sampleRate);
+#else
+  writeVarint(writer, 1);
+#endif
+  for (int i = 0; i < sgc->slotsCapacity; i++) {
+    SGC_Slot *slot = &sgc->slots[i];
+    if (!(slot->flags & SLOT_IN_USE))
+      continue;
+    writeBytes(writer, "O", 1);
+    writeVarint(writer, slot->address);
+    writeVarint(writer, slot->size);
+    writeVarint(writer, slot->flags & SLOT_ROOT ? 1 : 0);
+    slot->flags &= ~SLOT_ROOT;
+#ifdef SGC_PROFILE
+    size_t fileLength = slot->file != NULL ? strlen(slot->file) : 0;
+    writeVarint(writer, slot->line);
+    writeVarint(writer, fileLength);
+    writeBytes(writer, slot->file, fileLength);
+#else
+    writeVarint(writer, 0);
+    writeVarint(writer, 0);
+#endif
+    writeReferences(writer, slot);
+  }
+  writeBytes(writer, "E", 1);
+  flushWriter(writer);
+
+  int result = writer->failed ? -1 : 0;
+  free(writer);
+  return result;
+}
+
+/**
+ * Header of the result a marking child sends to the parent. It's followed
+ * by unreachableCount addresses and blacklistCount page numbers.
+ */
+typedef struct {
+  uintptr_t unreachableCount; /**< number of unreachable addresses */
+  uintptr_t blacklistCount;   /**< number of blacklisted pages */
+  uintptr_t falsePointers;    /**< number of false pointers found */
+} MarkResult;
+
+/**
+ * Runs in the forked child: mark the snapshot and write the result to fd.
+ * @param   fd write end of the pipe to the parent
+ */
+static void markInChild(int fd) {
+  clearBlacklist();
+  scanRoots();
+  trace();
+
+  MarkResult result = {0, sgc->blacklistCount, sgc->stats.falsePointers};
+  for (int i = 0; i < sgc->slotsCapacity; i++) {
+    SGC_Slot *slot = &sgc->slots[i];
+    if ((slot->flags & SLOT_IN_USE) && !(slot->flags & SLOT_MARKED))
+      result.unreachableCount++;
+  }
+
+  Writer *writer = newWriter(fd);
+  if (writer == NULL)
+    return;
+
+  writeBytes(writer, &result, sizeof(result));
+  for (int i = 0; i < sgc->slotsCapacity; i++) {
+    SGC_Slot *slot = &sgc->slots[i];
+    if ((slot->flags & SLOT_IN_USE) && !(slot->flags & SLOT_MARKED))
+      writeBytes(writer, &slot->address, sizeof(uintptr_t));
+  }
+  for (int i = 0; i < sgc->blacklistCapacity; i++) {
+    if (sgc->blacklist[i] != 0)
+      writeBytes(writer, &sgc->blacklist[i], sizeof(uintptr_t));
+  }
+  flushWriter(writer);
+}
+
+/**
+ * Fork a child that marks a snapshot of the memory. Collect at once if
+ * that's not possible.
+ */
+static void startMarking() {
+  int fds[2];
+  /* the program's own children mustn't inherit the read end */
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    sgc_collect();
+    return;
+  }
+#ifdef SGC_DEBUG
+  printf("-- fork marking child\n");
+  fflush(stdout); /* don't print buffered output twice */
+#endif
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    sgc_collect();
+    return;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    markInChild(fds[1]);
+    _exit(0);
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  sgc->markPid = pid;
+  sgc->markPipe = fds[0];
+  sgc->markCount = 0;
+}
+
+/**
+ * Free what the child found unreachable, except memory allocated since the
+ * fork, and take over the blacklist it built.
+ * @param   complete 0 if the child failed, then nothing is freed
+ */
+static void finishMarking(int complete) {
+  MarkResult result;
+  const uintptr_t *addresses =
+      (const uintptr_t *)(sgc->markBuffer + sizeof(MarkResult));
+  if (complete && sgc->markCount >= sizeof(MarkResult)) {
+    memcpy(&result, sgc->markBuffer, sizeof(MarkResult));
+    complete = sgc->markCount ==
+               sizeof(MarkResult) +
+                   (result.unreachableCount + result.blacklistCount) *
+                       sizeof(uintptr_t);
+  } else {
+    complete = 0;
+  }
+
+#ifdef SGC_DEBUG
+  printf("-- begin sweep after marking in child\n");
+  size_t before = sgc->bytesAllocated;
+#endif
+
+  if (complete) {
+    for (uintptr_t i = 0; i < result.unreachableCount; i++) {
+      SGC_Slot *slot = findSlot(addresses[i]);
+      if (slot != NULL && (slot->flags & SLOT_IN_USE) &&
+          !(slot->flags & SLOT_NEW))
+        freeSlot(slot);
+    }
+    clearBlacklist();
+    for (uintptr_t i = 0; i < result.blacklistCount; i++) {
+      blacklistAddress(addresses[result.unreachableCount + i]
+                       << BLACKLIST_PAGE_SHIFT);
+    }
+    sgc->stats.falsePointers = result.falsePointers;
+  }
+
+  /* allocations since the fork take part in the next collection */
+  sgc->stats.sharedPageBytes = 0;
+  for (int i = 0; i < sgc->slotsCapacity; i++) {
+    SGC_Slot *slot = &sgc->slots[i];
+    if (!(slot->flags & SLOT_IN_USE))
+      continue;
+    slot->flags &= ~SLOT_NEW;
+    if (isBlacklisted(slot->address))
+      sgc->stats.sharedPageBytes += slot->size;
+  }
+  sgc->stats.collections++;
+  releaseHeldMemory(0);
+
+  updateNextGC();
+
+#ifdef SGC_DEBUG
+  printf("-- end sweep after marking in child%s\n",
+         complete ? "" : " (child failed)");
+  printf("   freed %lu bytes (before %lu, now: %lu)\n",
+         before - sgc->bytesAllocated, before, sgc->bytesAllocated);
+#endif
+}
+
+/**
+ * Read what the marking child sent so far. If it's done, finish the
+ * collection.
+ * @param   wait if not 0 block until the child is done
+ */
+static void pollMarking(int wait) {
+  while (1) {
+    if (sgc->markCount == sgc->markCapacity) {
+      sgc->markCapacity = sgc->markCapacity == 0
+                              ? 4096
+                              : sgc->markCapacity * SLOTS_GROW_FACTOR;
+      sgc->markBuffer = realloc(sgc->markBuffer, sgc->markCapacity);
+      if (sgc->markBuffer == NULL)
+        exit(1);
+    }
+    ssize_t n = read(sgc->markPipe, sgc->markBuffer + sgc->markCount,
+                     sgc->markCapacity - sgc->markCount);
+    if (n > 0) {
+      sgc->markCount += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      if (!wait)
+        return; /* child is still marking */
+      struct pollfd pfd = {sgc->markPipe, POLLIN, 0};
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    break; /* end of file or error */
+  }
+
+  int status = 0;
+  pid_t pid;
+  do {
+    pid = waitpid(sgc->markPid, &status, 0);
+  } while (pid < 0 && errno == EINTR);
+  close(sgc->markPipe);
+  sgc->markPid = 0;
+  sgc->markPipe = -1;
+  /* if the program reaps its children itself (e.g. SIGCHLD is ignored)
+   * there is no status, finishMarking() still checks if the result is
+   * complete */
+  finishMarking(pid < 0 || (WIFEXITED(status) && WEXITSTATUS(status) == 0));
+}
+
+/**
+ * Runs in the marker thread: scan the roots and trace, a few slots at a
+ * time so allocations don't wait too long for the lock.
+ */
+static void *markThread(void *arg) {
+  (void)arg;
+  extern char end, etext; /* provided by the linker */
+  pthread_mutex_lock(&sgc->lock);
+  scanRegion(&end, &etext);
+  if (sgc->markStackTop != NULL)
+    scanStacks(sgc->markStack, sgc->markStackTop);
+  scanRegionChunks();
+  pthread_mutex_unlock(&sgc->lock);
+
+  int done = 0;
+  while (!done) {
+    pthread_mutex_lock(&sgc->lock);
+    for (int i = 0; i < CONCURRENT_TRACE_STEP && sgc->grayCount > 0; i++) {
+      traceNext();
+    }
+    done = sgc->grayCount == 0;
+    sgc->markThreadDone = done;
+    pthread_mutex_unlock(&sgc->lock);
+  }
+  return NULL;
+}
+
+/**
+ * Cache for entries of /proc/self/pagemap, so it's not read page by page.
+ */
+typedef struct {
+  int fd;             /**< /proc/self/pagemap, -1 means every page is dirty */
+  uintptr_t first;    /**< first page in entries */
+  size_t count;       /**< number of valid entries */
+  uint64_t entries[512]; /**< pagemap entries */
+} Pagemap;
+
+/**
+ * Check if page was written since the soft-dirty bits were cleared.
+ * @param   pagemap the pagemap cache
+ * @param   page page number
+ * @return  1 if dirty, 0 otherwise
+ */
+static int isPageDirty(Pagemap *pagemap, uintptr_t page) {
+  if (pagemap->fd < 0)
+    return 1;
+  if (page < pagemap->first || page >= pagemap->first + pagemap->count) {
+    ssize_t n = pread(pagemap->fd, pagemap->entries, sizeof(pagemap->entries),
+                      page * sizeof(uint64_t));
+    if (n < (ssize_t)sizeof(uint64_t))
+      return 1; /* be careful if the entry can't be read */
+    pagemap->first = page;
+    pagemap->count = n / sizeof(uint64_t);
+  }
+  return (pagemap->entries[page - pagemap->first] >> SOFT_DIRTY_BIT) & 1;
+}
+
+/**
+ * Check if any page of the memory range was written since the soft-dirty
+ * bits were cleared.
+ */
+static int isRangeDirty(Pagemap *pagemap, uintptr_t begin, uintptr_t end) {
+  for (uintptr_t page = begin >> SYSTEM_PAGE_SHIFT;
+       page <= (end - 1) >> SYSTEM_PAGE_SHIFT; page++) {
+    if (isPageDirty(pagemap, page))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Clear the soft-dirty bits of all pages of the process.
+ * Some kernels accept the request without tracking soft-dirty pages, so
+ * check if writing the SGC struct sets the bit of its page.
+ * @return  0 on success, -1 if the kernel doesn't support it
+ */
+static int clearSoftDirty() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0)
+    return -1;
+  int result = write(fd, "4", 1) == 1 ? 0 : -1;
+  close(fd);
+  if (result != 0)
+    return -1;
+
+  Pagemap pagemap = {open("/proc/self/pagemap", O_RDONLY), 0, 0, {0}};
+  if (pagemap.fd < 0)
+    return -1;
+  sgc->markThreadDone = 0;
+  result = isPageDirty(&pagemap,
+                       (uintptr_t)&sgc->markThreadDone >> SYSTEM_PAGE_SHIFT)
+               ? 0
+               : -1;
+  close(pagemap.fd);
+  return result;
+}
+
+/**
+ * Start a concurrent marker thread. Collect at once if that's not possible.
+ */
+static void startMarkThread() {
+  if (clearSoftDirty() != 0) {
+#ifdef SGC_DEBUG
+    printf("-- soft-dirty bits not supported, stop the world instead\n");
+#endif
+    sgc->mode = SGC_MODE_STOP_THE_WORLD;
+    sgc_collect();
+    return;
+  }
+#ifdef SGC_DEBUG
+  printf("-- start marker thread\n");
+#endif
+  clearBlacklist();
+  sgc->stats.sharedPageBytes = 0;
+  sgc->markStackTop = getStackTop();
+  sgc->markStack = currentStack(sgc->markStackTop);
+  sgc->markThreadDone = 0;
+  sgc->markThreadRunning = 1;
+  if (pthread_create(&sgc->markThread, NULL, markThread, NULL) != 0) {
+    sgc->markThreadRunning = 0;
+    sgc_collect();
+  }
+}
+
+/**
+ * Scan the dirty pages of a region for known pointers.
+ */
+static void scanDirtyPages(Pagemap *pagemap, void *begin, void *end) {
+  uintptr_t low = (uintptr_t)(begin < end ? begin : end);
+  uintptr_t high = (uintptr_t)(begin < end ? end : begin);
+  while (low < high) {
+    uintptr_t pageEnd = ((low >> SYSTEM_PAGE_SHIFT) + 1) << SYSTEM_PAGE_SHIFT;
+    if (pageEnd > high)
+      pageEnd = high;
+    if (isPageDirty(pagemap, low >> SYSTEM_PAGE_SHIFT))
+      scanRegion((void *)low, (void *)pageEnd);
+    low = pageEnd;
+  }
+}
+
+static int compareSlotAddress(const void *a, const void *b) {
+  uintptr_t x = (*(SGC_Slot *const *)a)->address;
+  uintptr_t y = (*(SGC_Slot *const *)b)->address;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Finish the collection after the marker thread is done.
+ *
+ * Everything that was written while the thread was marking might hide
+ * pointers it didn't see. So rescan the stack, the dirty pages of data
+ * segment and BSS and all marked slots on dirty pages, then trace and
+ * sweep as usual. Only dirty memory is scanned, but finding the marked
+ * slots on dirty pages sorts all of them (O(n log n)) and the sweep visits
+ * every slot, so the pause grows with the heap.
+ */
+static void finishMarkThread() {
+  pthread_join(sgc->markThread, NULL);
+  sgc->markThreadRunning = 0;
+
+#ifdef SGC_DEBUG
+  printf("-- finish marking of marker thread\n");
+  size_t before = sgc->bytesAllocated;
+#endif
+
+  Pagemap *pagemap = malloc(sizeof(Pagemap));
+  if (pagemap == NULL)
+    exit(1);
+  pagemap->fd = open("/proc/self/pagemap", O_RDONLY);
+  pagemap->first = 0;
+  pagemap->count = 0;
+
+  extern char end, etext; /* provided by the linker */
+  scanDirtyPages(pagemap, &end, &etext);
+  scanStack();
+  for (SGC_Region *region = sgc->region; region != NULL;
+       region = region->parent) {
+    for (SGC_RegionChunk *chunk = region->chunks; chunk != NULL;
+         chunk = chunk->next) {
+      scanDirtyPages(pagemap, chunkData(chunk),
+                     chunkData(chunk) + chunk->used);
+    }
+  }
+
+  /* sort marked slots by address, so the pagemap is read in order */
+  SGC_Slot **marked = malloc((sgc->slotsCount + 1) * sizeof(SGC_Slot *));
+  if (marked == NULL)
+    exit(1);
+  int markedCount = 0;
+  for (int i = 0; i < sgc->slotsCapacity; i++) {
+    SGC_Slot *slot = &sgc->slots[i];
+    if ((slot->flags & SLOT_IN_USE) && (slot->flags & SLOT_MARKED))
+      marked[markedCount++] = slot;
+  }
+  qsort(marked, markedCount, sizeof(SGC_Slot *), compareSlotAddress);
+  for (int i = 0; i < markedCount; i++) {
+    SGC_Slot *slot = marked[i];
+    if (slot->size > 0 &&
+        isRangeDirty(pagemap, slot->address, slot->address + slot->size))
+      scanSlot(slot);
+  }
+  free(marked);
+  if (pagemap->fd >= 0)
+    close(pagemap->fd);
+  free(pagemap);
+
+  trace();
+  sweep();
+  sgc->stats.collections++;
+  releaseHeldMemory(0);
+
+  updateNextGC();
+
+#ifdef SGC_DEBUG
+  printf("-- end collection\n");
+  printf("   freed %lu bytes (before %lu, now: %lu)\n",
+         before - sgc->bytesAllocated, before, sgc->bytesAllocated);
+#endif
+}
+
+/**
+ * Finish the collection if the marker thread is done.
+ * @param   wait if not 0 wait for the marker thread
+ */
+static void pollMarkThread(int wait) {
+  if (!wait) {
+    pthread_mutex_lock(&sgc->lock);
+    int done = sgc->markThreadDone;
+    pthread_mutex_unlock(&sgc->lock);
+    if (!done)
+      return;
+  }
+  finishMarkThread();
+}
+
+void sgc_set_mode(SGC_Mode mode) {
+  if (sgc->markPid != 0)
+    pollMarking(1);
+  if (sgc->markThreadRunning)
+    pollMarkThread(1);
+  sgc->mode = mode;
+}
+
+SGC_Mode sgc_get_mode() { return sgc->mode; }
+
+/**
+ * Format (all numbers are LEB128 varints):
+ *   "SGCT" version
+ *   events:
+ *     'M' address size                      sgc_malloc()
+ *     'R' oldAddress newAddress newSize     sgc_realloc()
+ *     'F' address                           memory freed
+ *     'C'                                   begin of a collection
+ *     'r' address                           reference from a root
+ *     'e' address offset target             reference at address + offset
+ *     'c' nanoseconds                       end of a collection
+ * Memory is freed within a collection (between 'C' and 'c') or by
+ * sgc_free(). Allocations in regions are not recorded.
+ */
+int sgc_trace_start(int fd) {
+  sgc_trace_stop();
+  /* finish a collection in progress, so all references are recorded */
+  if (sgc->markPid != 0)
+    pollMarking(1);
+  if (sgc->markThreadRunning)
+    pollMarkThread(1);
+
+  sgc->trace = newWriter(fd);
+  if (sgc->trace == NULL)
+    return -1;
+  writeBytes(sgc->trace, "SGCT", 4);
+  writeVarint(sgc->trace, 1);
+  return 0;
+}
+
+int sgc_trace_stop() {
+  if (sgc->trace == NULL)
+    return 0;
+  flushWriter(sgc->trace);
+  int result = sgc->trace->failed ? -1 : 0;
+  free(sgc->trace);
+  sgc->trace = NULL;
+  return result;
+}
@@ -4,43 +4,192 @@
 #ifndef SGC_H
 #define SGC_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // #define SGC_DEBUG  /**< show debug messages */
 // #define SGC_STRESS  /**< run collection before any allocation */
 // #define SGC_DEBUG_HASHTABLE  /**< inform about collisions, growing, etc */
+// #define SGC_PROFILE  /**< record allocation sites of sampled allocations */
 
 typedef enum Flags {
   SLOT_UNUSED = 0,
   SLOT_IN_USE = 1,
   SLOT_MARKED = 2,
-  SLOT_TOMBSTONE = 4
+  SLOT_TOMBSTONE = 4,
+  SLOT_ROOT = 8, /**< referenced from a root, only used by sgc_dump_heap() */
+  SLOT_NEW = 16,   /**< allocated while a forked child is marking */
+  SLOT_MAPPED = 32 /**< memory is an anonymous mapping, not from malloc() */
 } Flags;
 
+/**
+ * How collections are done, see sgc_set_mode().
+ */
+typedef enum {
+  SGC_MODE_STOP_THE_WORLD, /**< scan, trace and sweep at once (default) */
+  SGC_MODE_FORK, /**< mark in a forked child, sweep later in the process */
+  SGC_MODE_SOFT_DIRTY /**< mark in a thread, rescan pages written meanwhile */
+} SGC_Mode;
+
+/**
+ * Where the pointers are in memory allocated with sgc_malloc_typed().
+ * The memory is an array of elements of size bytes, each with pointers at
+ * the given offsets. src/sgc.hpp generates descriptors for C++ types.
+ */
+typedef struct {
+  size_t size;           /**< size of one element */
+  size_t count;          /**< number of pointers in an element */
+  const size_t *offsets; /**< offsets of the pointers in an element */
+} SGC_Descriptor;
+
 /**
  * Hold information about managed allocated memory.
  */
 struct SGC_Slot_ {
   size_t size; /**< size of the allocated memory */
   Flags flags; /**< flags for use in the hash table */
+  const SGC_Descriptor *descriptor; /**< where the pointers are, NULL if
+                                         every word may be one */
 #ifdef SGC_DEBUG
   int id; /**< identifier useful for debugging */
+#endif
+#ifdef SGC_PROFILE
+  const char *file; /**< source file of the allocation (NULL if not sampled) */
+  int line;         /**< source line of the allocation */
 #endif
   uintptr_t address; /**< address of managed memory */
 };
 typedef struct SGC_Slot_ SGC_Slot;
 
+/* the tuning parameters can be overridden when compiling, e.g. to compare
+ * them with tools/replay.c */
+#ifndef SLOTS_MAX_LOAD
 #define SLOTS_MAX_LOAD                                                         \
   0.75 /**< if the hash table holding the slot informations is fuller, it will \
           be increased */
+#endif
+#ifndef SLOTS_INITIAL_CAPACITY
 #define SLOTS_INITIAL_CAPACITY                                                 \
   8 /**< initial capacity of hash table and lists */
+#endif
+#ifndef SLOTS_GROW_FACTOR
 #define SLOTS_GROW_FACTOR                                                      \
   2 /**< if hash tables or lists become to small, they will be increased by    \
        this factor */
+#endif
+#ifndef HEAP_GROW_FACTOR
 #define HEAP_GROW_FACTOR                                                       \
   2 /**< how much more memory to allocate before next collection */
+#endif
+#ifndef LARGE_ALLOCATION_SIZE
+#define LARGE_ALLOCATION_SIZE                                                  \
+  (128 * 1024) /**< allocations of at least this size get their own       \
+                    anonymous mapping, which is zero filled */
+#endif
+#define SOFT_LIMIT_FRACTION                                                    \
+  0.75 /**< default soft heap limit relative to the hard limit */
+#define CGROUP_HEADROOM_FRACTION                                               \
+  0.1 /**< part of the cgroup memory limit kept free for memory that isn't \
+         managed (slot table, malloc() overhead, held back memory, ...) */
+#define BLACKLIST_PAGE_SHIFT                                                   \
+  12 /**< log2 of the page size used for blacklisting (4096 bytes) */
+#define BLACKLIST_NEAR                                                         \
+  (64 * 1024) /**< values this close to the managed address range are        \
+                 treated as possible future false pointers */
+#define BLACKLIST_MAX_RETRIES                                                  \
+  8 /**< how often to retry an allocation that landed on a blacklisted page \
+       (for a mapping: how many pages to skip at most) */
+#define BLACKLIST_MAX_HELD                                                     \
+  (1024 * 1024) /**< at most this many bytes are held back at once, above   \
+                   it blacklisted pages are used anyway */
+#define BLACKLIST_HOLD_COLLECTIONS                                             \
+  4 /**< held back memory is released after this many collections, even if \
+       its page is still blacklisted */
+#define SYSTEM_PAGE_SHIFT                                                      \
+  12 /**< log2 of the page size of the system (4096 bytes on x64) */
+#define SOFT_DIRTY_BIT                                                         \
+  55 /**< bit of a /proc/self/pagemap entry set if the page was written */
+#define CONCURRENT_TRACE_STEP                                                  \
+  64 /**< number of slots the marker thread traces per locking */
+#define MARK_POLL_INTERVAL                                                     \
+  64 /**< allocations between checks for the result of a marking child */
+#define REGION_CHUNK_SIZE                                                      \
+  (64 * 1024) /**< minimal size of the memory chunks of a region */
+#define REGION_ALIGNMENT                                                       \
+  16 /**< alignment of allocations in a region (like malloc() on x64) */
+#define PROFILE_SAMPLE_RATE                                                    \
+  16 /**< by default record the allocation site of every n-th allocation */
+
+/**
+ * Statistics about the collector, see sgc_get_stats().
+ */
+typedef struct {
+  size_t bytesAllocated;   /**< number of bytes currently managed */
+  size_t collections;      /**< number of collections done so far */
+  size_t falsePointers;    /**< values found during the last collection that
+                              pointed near managed memory but not at an
+                              allocation */
+  size_t blacklistedPages; /**< number of pages currently blacklisted */
+  size_t blacklistedBytes; /**< memory held back from the allocator because
+                              it was on a blacklisted page */
+  size_t regionBytes;      /**< memory of the chunks of active regions */
+  size_t sharedPageBytes;  /**< live memory starting on a blacklisted page.
+                              Only a hint where false pointers are: a value
+                              that retains memory points at its start, so
+                              it's never counted as a false pointer */
+  size_t emergencyCollections; /**< collections done because an allocation
+                                  failed or hit the hard limit */
+} SGC_Stats;
+
+/**
+ * Memory held back because it was on a blacklisted page, see
+ * allocateMemory().
+ */
+struct SGC_Held_ {
+  uintptr_t address; /**< address of the memory */
+  size_t size;       /**< size of the memory */
+  size_t collection; /**< number of collections done when it was held */
+};
+typedef struct SGC_Held_ SGC_Held;
+
+/**
+ * Memory chunk of a region. The allocations follow the struct, each after
+ * REGION_ALIGNMENT bytes that hold its size.
+ */
+struct SGC_RegionChunk_ {
+  struct SGC_RegionChunk_ *next; /**< previously filled chunk */
+  size_t capacity; /**< number of bytes available for allocations */
+  size_t used;     /**< number of bytes allocated (bump pointer) */
+  size_t last;     /**< offset of the last allocation (of its size) */
+};
+typedef struct SGC_RegionChunk_ SGC_RegionChunk;
+
+/**
+ * Region started by sgc_region_begin(). Allocations are taken from its
+ * chunks and all freed together by sgc_region_end().
+ */
+struct SGC_Region_ {
+  struct SGC_Region_ *parent; /**< enclosing region, NULL if none */
+  SGC_RegionChunk *chunks;    /**< current chunk, NULL if none yet */
+};
+typedef struct SGC_Region_ SGC_Region;
+
+/**
+ * Additional stack (e.g. of a coroutine), see sgc_stack_register().
+ */
+struct SGC_Stack_ {
+  struct SGC_Stack_ *next; /**< next registered stack */
+  void *begin;  /**< lowest address of the stack memory */
+  void *bottom; /**< highest address of the stack (stacks grow down) */
+  void *top; /**< top of the stack when it was left, NULL if never used or
+                 left without sgc_stack_switch() */
+};
+typedef struct SGC_Stack_ SGC_Stack;
 
 /**
  * Main SGC struct.
@@ -51,6 +200,12 @@ typedef struct {
   void *stackBottom; /**< pointer to lowest part of the stack (has to be
                         aligned) */
 
+  /* additional stacks for coroutines. Only the active stack is scanned up
+   * to its current top, the others up to where they were left. */
+  SGC_Stack *stacks;      /**< list of registered stacks */
+  SGC_Stack *activeStack; /**< stack in use, NULL for the main stack */
+  void *mainStackTop;     /**< top of the main stack when it was left */
+
   uintptr_t minAddress; /**< lower bound of managed allocated memory */
   uintptr_t maxAddress; /**< upper bound of managed allocated memory */
 
@@ -58,6 +213,8 @@ typedef struct {
   size_t bytesAllocated; /**< number of bytes currently managed */
   size_t
       nextGC; /**< number of allocated bytes to trigger the next collection */
+  size_t softLimit; /**< collect more often above this, 0 if no limit */
+  size_t hardLimit; /**< never manage more bytes than this, 0 if no limit */
 
   /* slots hold information about allocated memory.
    * They are stored in a hash map mapping the memory address to the slot. */
@@ -73,9 +230,60 @@ typedef struct {
   int grayCapacity;    /**< capacity of grayList */
   SGC_Slot **grayList; /**< gray list (tricolor abstraction) */
 
+  /* blacklist is a hash set of page numbers that false pointers (values near
+   * managed memory that don't point to an allocation) were found on during
+   * the last collection. New allocations avoid these pages. */
+  int blacklistCount;    /**< number of blacklisted pages */
+  int blacklistCapacity; /**< capacity of the blacklist hash set */
+  uintptr_t *blacklist;  /**< blacklist hash set, 0 marks an empty entry */
+
+  /* heldList holds memory returned by malloc() on a blacklisted page. It is
+   * kept out of use until its page is not blacklisted anymore, or for
+   * BLACKLIST_HOLD_COLLECTIONS collections at most. The held bytes are
+   * counted in stats.blacklistedBytes. */
+  int heldCount;       /**< number of elements in heldList */
+  int heldCapacity;    /**< capacity of heldList */
+  SGC_Held *heldList;  /**< held back memory */
+
+  SGC_Stats stats; /**< statistics, updated during collections */
+
+  SGC_Region *region; /**< innermost active region, NULL if none */
+  int zeroOnFree;     /**< clear memory before it's freed */
+
+  /* allocation trace, see sgc_trace_start() */
+  struct SGC_Writer_ *trace; /**< writer of the trace, NULL if none */
+  SGC_Slot *traceSource;     /**< slot being scanned, NULL for roots */
+  int traceReferences;       /**< set while references are recorded */
+  int findingRoots; /**< set while sgc_dump_heap() scans the roots again,
+                       nothing is blacklisted then */
+
+  SGC_Mode mode; /**< how collections are done */
+
+  /* a forked child marks a copy-on-write snapshot of the process and sends
+   * the unreachable addresses back through a pipe (SGC_MODE_FORK) */
+  int markPid;              /**< pid of the marking child, 0 if none */
+  int markPipe;             /**< read end of the pipe to the child */
+  size_t markCount;         /**< number of bytes received from the child */
+  size_t markCapacity;      /**< capacity of markBuffer */
+  uint8_t *markBuffer;      /**< bytes received from the child */
+  unsigned markPollCounter; /**< allocations since the pipe was read */
+
+  /* a marker thread marks while the program keeps running. Pages written
+   * meanwhile are found by their soft-dirty bit (SGC_MODE_SOFT_DIRTY) */
+  pthread_t markThread;    /**< the marker thread */
+  int markThreadRunning;   /**< set while the marker thread exists */
+  int markThreadDone;      /**< set by the marker thread when it's done */
+  void *markStackTop;      /**< top of the stack when marking started */
+  SGC_Stack *markStack;    /**< stack in use when marking started */
+  pthread_mutex_t lock;    /**< protects this struct while the thread runs */
+
 #ifdef SGC_DEBUG
   int lastId; /**< used to assign unque IDs to slots for debugging */
 #endif
+#ifdef SGC_PROFILE
+  unsigned sampleRate;    /**< record the site of every n-th allocation */
+  unsigned sampleCounter; /**< allocations until the next sample */
+#endif
 } SGC;
 
 /**
@@ -124,6 +332,169 @@ void *sgc_malloc(size_t size);
  */
 void *sgc_realloc(void *ptr, size_t newSize);
 
+/**
+ * Allocate managed memory for count elements of size bytes, set to zero.
+ * Large allocations come from fresh anonymous mappings, which are zero
+ * already, so only smaller ones are cleared.
+ * @param   count number of elements
+ * @param   size size of an element
+ * @return  pointer to the allocated memory, NULL if out of memory or
+ *          count * size overflows
+ */
+void *sgc_calloc(size_t count, size_t size);
+
+/**
+ * Allocate managed memory whose pointers are all described by descriptor.
+ * Only those words are scanned when tracing, instead of the whole memory.
+ * The memory may hold multiple elements (e.g. an array), each
+ * descriptor->size bytes big. The descriptor must outlive the memory.
+ * Reallocating keeps the descriptor.
+ * @param   size number of bytes to allocate
+ * @param   descriptor where the pointers are, NULL to scan every word
+ * @return  pointer to the allocated memory
+ */
+void *sgc_malloc_typed(size_t size, const SGC_Descriptor *descriptor);
+
+/**
+ * Like sgc_malloc(), but also pass the allocation site.
+ * With SGC_PROFILE defined sgc_malloc(), sgc_realloc(), sgc_calloc() and
+ * sgc_malloc_typed() are macros that call the _at() variant with the
+ * current file and line.
+ * @param   size number of bytes to allocate
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+void *sgc_malloc_at(size_t size, const char *file, int line);
+
+/**
+ * Like sgc_realloc(), but also pass the allocation site.
+ * @param   ptr the pointer to reallocate
+ * @param   newSize number of bytes to allocate
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+void *sgc_realloc_at(void *ptr, size_t newSize, const char *file, int line);
+
+/**
+ * Like sgc_calloc(), but also pass the allocation site.
+ * @param   count number of elements
+ * @param   size size of an element
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+void *sgc_calloc_at(size_t count, size_t size, const char *file, int line);
+
+/**
+ * Like sgc_malloc_typed(), but also pass the allocation site.
+ * @param   size number of bytes to allocate
+ * @param   descriptor where the pointers are, NULL to scan every word
+ * @param   file source file of the call
+ * @param   line source line of the call
+ * @return  pointer to the allocated memory
+ */
+void *sgc_malloc_typed_at(size_t size, const SGC_Descriptor *descriptor,
+                          const char *file, int line);
+
+#ifdef SGC_PROFILE
+#define sgc_malloc(size) sgc_malloc_at((size), __FILE__, __LINE__)
+#define sgc_realloc(ptr, size) sgc_realloc_at((ptr), (size), __FILE__, __LINE__)
+#define sgc_calloc(count, size)                                                \
+  sgc_calloc_at((count), (size), __FILE__, __LINE__)
+#define sgc_malloc_typed(size, descriptor)                                     \
+  sgc_malloc_typed_at((size), (descriptor), __FILE__, __LINE__)
+
+/**
+ * Set how often an allocation site is recorded.
+ * @param   rate record the site of every rate-th allocation (1 records all)
+ */
+void sgc_set_sample_rate(unsigned rate);
+#endif
+
+/**
+ * Limit the amount of managed memory.
+ * Above the soft limit collections are done more often, the closer to the
+ * hard limit the more often. Allocations that would exceed the hard limit
+ * fail (return NULL) if a collection doesn't free enough memory. The
+ * chunks of regions count against the hard limit as well.
+ * By default the limits are set from the cgroup v2 memory.max of the
+ * process: the hard limit to what's left of it when SGC is initialized
+ * (memory.max - memory.current), minus CGROUP_HEADROOM_FRACTION of
+ * memory.max for memory that isn't managed. The soft limit is
+ * SOFT_LIMIT_FRACTION of the hard limit.
+ * @param   softLimit number of bytes, 0 for SOFT_LIMIT_FRACTION of hardLimit
+ * @param   hardLimit number of bytes, 0 for no limits at all
+ */
+void sgc_set_heap_limit(size_t softLimit, size_t hardLimit);
+
+/**
+ * Clear memory before it's freed by a collection, sgc_free(),
+ * sgc_realloc() moving it or sgc_region_end() (disabled by default).
+ * Stale pointers left in freed memory can't keep objects alive when the
+ * memory is reused by sgc_malloc() then. Large allocations are unmapped,
+ * so they never need it. With it, sgc_realloc() always moves memory that
+ * isn't mapped.
+ * @param   enabled 1 to clear freed memory, 0 to leave it as it is
+ */
+void sgc_set_zero_on_free(int enabled);
+
+/**
+ * Free memory allocated by sgc_malloc() or sgc_realloc() at once,
+ * instead of waiting for a collection. Memory allocated in a region is only
+ * released at once if it was the last allocation, otherwise with
+ * sgc_region_end().
+ * @param   ptr the pointer to free, does nothing if NULL
+ */
+void sgc_free(void *ptr);
+
+/**
+ * Start a region.
+ * Until sgc_region_end() all allocations are bump allocated from
+ * memory chunks of the region instead of being managed separately, and no
+ * collections are triggered by them. Memory of an active region is scanned
+ * for pointers like the stack. Regions can be nested.
+ * The region is global: it captures every allocation until it ends, also
+ * those of other coroutines running meanwhile and typed allocations (which
+ * are scanned conservatively then). sgc_region_end() frees all of them, so
+ * nothing allocated in the region may be used afterwards.
+ */
+void sgc_region_begin();
+
+/**
+ * End the innermost region and free all memory allocated in it.
+ * Pointers to that memory must not be used anymore.
+ */
+void sgc_region_end();
+
+/**
+ * Register an additional stack, e.g. of a coroutine, to be scanned for
+ * pointers. It's not scanned until it was left with sgc_stack_switch()
+ * for the first time.
+ * @param   begin lowest address of the stack memory
+ * @param   size size of the stack memory
+ * @return  handle for sgc_stack_switch() and sgc_stack_unregister()
+ */
+SGC_Stack *sgc_stack_register(void *begin, size_t size);
+
+/**
+ * Stop scanning a stack registered with sgc_stack_register().
+ * It must not be the stack currently in use.
+ * @param   stack the handle returned by sgc_stack_register()
+ */
+void sgc_stack_unregister(SGC_Stack *stack);
+
+/**
+ * Tell SGC the program is about to switch to another stack.
+ * Call it right before swapcontext() (or whatever is used to switch), so
+ * the top of the current stack is remembered. A coroutine that ends and
+ * continues in another context through uc_link doesn't need to call it,
+ * SGC finds out which stack is in use from the address of the stack top.
+ * @param   to the stack to switch to, NULL for the main stack
+ */
+void sgc_stack_switch(SGC_Stack *to);
+
 /**
  * Run the garbage collector.
  * There is no need to call this function manually, but you
@@ -131,4 +502,65 @@ void *sgc_realloc(void *ptr, size_t newSize);
  */
 void sgc_collect();
 
+/**
+ * Choose how collections are done.
+ * With SGC_MODE_FORK an automatic collection forks the process. The child
+ * marks a copy-on-write snapshot of the memory while the program keeps
+ * running, and the unreachable memory is freed by a later allocation.
+ * sgc_collect() always waits for a running child and collects at once.
+ * With SGC_MODE_SOFT_DIRTY a thread marks while the program keeps running.
+ * A later allocation rescans the pages written meanwhile (found by their
+ * soft-dirty bit) and sweeps. Compile with -pthread.
+ * Both modes are Linux only and fall back to a normal collection if they
+ * are not available.
+ * @param   mode the collection mode
+ */
+void sgc_set_mode(SGC_Mode mode);
+
+/**
+ * Get how collections are done.
+ * @return  the mode set with sgc_set_mode(), or SGC_MODE_STOP_THE_WORLD
+ *          if it wasn't available when a collection was started
+ */
+SGC_Mode sgc_get_mode();
+
+/**
+ * Get statistics about the collector.
+ * @param   stats filled with the current statistics
+ */
+void sgc_get_stats(SGC_Stats *stats);
+
+/**
+ * Write all live allocations to fd.
+ * A collection is done first. For every allocation its address, size,
+ * allocation site (if sampled) and the addresses of the allocations it
+ * references are written in a compact binary format, which can be
+ * analyzed with tools/heapstat.c. The sample rate is written too, so the
+ * sampled sites can be scaled up.
+ * @param   fd file descriptor to write to
+ * @return  0 on success, -1 if writing failed
+ */
+int sgc_dump_heap(int fd);
+
+/**
+ * Start recording an allocation trace to fd.
+ * Every allocation, reallocation, collection and free is written in a
+ * compact binary format. For every collection the references found are
+ * written too, so tools/replay.c can replay the trace. While recording,
+ * collections are always stop-the-world.
+ * @param   fd file descriptor to write to
+ * @return  0 on success, -1 if out of memory
+ */
+int sgc_trace_start(int fd);
+
+/**
+ * Stop recording the allocation trace and write what's buffered.
+ * @return  0 on success, -1 if writing failed
+ */
+int sgc_trace_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
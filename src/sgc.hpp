@@ -0,0 +1,256 @@
+/**
+ * C++ layer of the Simple Garbage Collector (header only).
+ *
+ * - sgc::layout<T> describes where the pointers of T are. It's generated at
+ *   compile time for arithmetic, enum and pointer types, and declared with
+ *   SGC_LAYOUT() for classes. Types without a layout are scanned
+ *   conservatively, like memory from sgc_malloc().
+ * - sgc::gc_new<T>() allocates and constructs a T, sgc::gc_ptr<T> points to
+ *   it. Destructors are never called, the memory is reclaimed by the
+ *   collector.
+ * - sgc::allocator<T> makes STL containers allocate managed memory. The
+ *   container itself has to be on the stack, in a global or in managed
+ *   memory, so the collector finds its pointer.
+ */
+#ifndef SGC_HPP
+#define SGC_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "sgc.h"
+
+namespace sgc {
+
+namespace detail {
+constexpr bool fits(std::size_t) { return true; }
+
+/**
+ * Check that all pointers at offsets are within an object of size bytes.
+ */
+template <typename... Offsets>
+constexpr bool fits(std::size_t size, std::size_t offset, Offsets... offsets) {
+  return offset + sizeof(void *) <= size && fits(size, offsets...);
+}
+} // namespace detail
+
+/**
+ * Layout of T with pointers at the given offsets.
+ */
+template <typename T, std::size_t... Offsets> struct pointer_offsets {
+  static_assert(detail::fits(sizeof(T), Offsets...),
+                "pointer offset outside of the type");
+
+  static const SGC_Descriptor *descriptor() {
+    static const std::size_t offsets[] = {Offsets..., 0};
+    static const SGC_Descriptor descriptor = {sizeof(T), sizeof...(Offsets),
+                                              offsets};
+    return &descriptor;
+  }
+};
+
+/**
+ * Where the pointers of T are. By default it's unknown (nullptr), so
+ * objects of T are scanned conservatively.
+ */
+template <typename T, typename Enable = void> struct layout {
+  static const SGC_Descriptor *descriptor() { return nullptr; }
+};
+
+/* numbers never hold pointers */
+template <typename T>
+struct layout<T, typename std::enable_if<std::is_arithmetic<T>::value ||
+                                         std::is_enum<T>::value>::type>
+    : pointer_offsets<T> {};
+
+/* a pointer is a pointer */
+template <typename T> struct layout<T *> : pointer_offsets<T *, 0> {};
+
+/**
+ * Pointer to an object allocated with gc_new(). It's just a plain pointer,
+ * so the collector finds it wherever it is.
+ *
+ * The collector only recognizes the address an object starts at. A
+ * conversion that adjusts the pointer (to a non-primary or virtual base)
+ * would point into the middle of the object and keep nothing alive, so
+ * gc_ptr<U> only converts to gc_ptr<T> when the address stays the same:
+ * the same type or a standard-layout U, whose bases all start at its own
+ * address.
+ */
+template <typename T> class gc_ptr {
+public:
+  gc_ptr() : ptr_(nullptr) {}
+  gc_ptr(std::nullptr_t) : ptr_(nullptr) {}
+  explicit gc_ptr(T *ptr) : ptr_(ptr) {}
+  template <typename U,
+            typename = typename std::enable_if<
+                std::is_convertible<U *, T *>::value &&
+                (std::is_same<typename std::remove_cv<U>::type,
+                              typename std::remove_cv<T>::type>::value ||
+                 std::is_standard_layout<U>::value)>::type>
+  gc_ptr(const gc_ptr<U> &other) : ptr_(other.get()) {}
+
+  T *get() const { return ptr_; }
+  T &operator*() const { return *ptr_; }
+  T *operator->() const { return ptr_; }
+  explicit operator bool() const { return ptr_ != nullptr; }
+
+private:
+  T *ptr_;
+};
+
+template <typename T, typename U>
+bool operator==(const gc_ptr<T> &a, const gc_ptr<U> &b) {
+  return a.get() == b.get();
+}
+template <typename T, typename U>
+bool operator!=(const gc_ptr<T> &a, const gc_ptr<U> &b) {
+  return a.get() != b.get();
+}
+template <typename T> bool operator==(const gc_ptr<T> &a, std::nullptr_t) {
+  return a.get() == nullptr;
+}
+template <typename T> bool operator!=(const gc_ptr<T> &a, std::nullptr_t) {
+  return a.get() != nullptr;
+}
+
+template <typename T> struct layout<gc_ptr<T>> : pointer_offsets<gc_ptr<T>, 0> {
+};
+
+namespace detail {
+/**
+ * Whether a member of type T is a pointer the collector can follow.
+ */
+template <typename T> struct is_traced_pointer : std::false_type {};
+template <typename T> struct is_traced_pointer<T *> : std::true_type {};
+template <typename T> struct is_traced_pointer<gc_ptr<T>> : std::true_type {};
+template <typename T>
+struct is_traced_pointer<const T> : is_traced_pointer<T> {};
+template <typename T>
+struct is_traced_pointer<volatile T> : is_traced_pointer<T> {};
+template <typename T>
+struct is_traced_pointer<const volatile T> : is_traced_pointer<T> {};
+} // namespace detail
+
+/**
+ * Like gc_new(), but also pass the allocation site for SGC_PROFILE. Use it
+ * through SGC_NEW(), which passes the current file and line.
+ * @throw   std::bad_alloc if out of memory
+ */
+template <typename T, typename... Args>
+gc_ptr<T> gc_new_at(const char *file, int line, Args &&...args) {
+  void *memory =
+      sgc_malloc_typed_at(sizeof(T), layout<T>::descriptor(), file, line);
+  if (memory == nullptr)
+    throw std::bad_alloc();
+  return gc_ptr<T>(new (memory) T(std::forward<Args>(args)...));
+}
+
+/**
+ * Allocate managed memory for a T and construct it with args.
+ * @throw   std::bad_alloc if out of memory
+ */
+template <typename T, typename... Args> gc_ptr<T> gc_new(Args &&...args) {
+  return gc_new_at<T>(nullptr, 0, std::forward<Args>(args)...);
+}
+
+/**
+ * Allocator for STL containers, using managed memory scanned with the
+ * layout of T. With SGC_PROFILE the allocations of all containers share
+ * one allocation site (in this file).
+ */
+template <typename T> class allocator {
+public:
+  using value_type = T;
+
+  allocator() noexcept {}
+  template <typename U> allocator(const allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > static_cast<std::size_t>(-1) / sizeof(T))
+      throw std::bad_alloc();
+    void *memory = sgc_malloc_typed_at(n * sizeof(T), layout<T>::descriptor(),
+                                       __FILE__, __LINE__);
+    if (memory == nullptr)
+      throw std::bad_alloc();
+    return static_cast<T *>(memory);
+  }
+
+  void deallocate(T *ptr, std::size_t) noexcept { sgc_free(ptr); }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &, const allocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const allocator<T> &, const allocator<U> &) {
+  return false;
+}
+
+} // namespace sgc
+
+/**
+ * Declare the pointer members of a class, use it in the global namespace:
+ *   SGC_LAYOUT(Node, left, right)
+ *   SGC_LAYOUT(Buffer)  (no pointers at all)
+ * Each member has to be a raw pointer or a gc_ptr, up to 15 of them.
+ * Without it, objects of the class are scanned conservatively.
+ */
+#define SGC_LAYOUT(...)                                                        \
+  namespace sgc {                                                              \
+  template <>                                                                  \
+  struct layout<SGC_LAYOUT_TYPE_(__VA_ARGS__, 0)>                              \
+      : pointer_offsets<SGC_LAYOUT_TYPE_(__VA_ARGS__, 0) SGC_LAYOUT_EACH_(     \
+            SGC_LAYOUT_OFFSET_, __VA_ARGS__)> {                                \
+    SGC_LAYOUT_EACH_(SGC_LAYOUT_CHECK_, __VA_ARGS__)                           \
+  };                                                                           \
+  }
+#define SGC_LAYOUT_TYPE_(Type, ...) Type
+#define SGC_LAYOUT_OFFSET_(Type, member) , offsetof(Type, member)
+#define SGC_LAYOUT_CHECK_(Type, member)                                        \
+  static_assert(detail::is_traced_pointer<decltype(Type::member)>::value,      \
+                #member " is neither a pointer nor a gc_ptr");
+
+/* apply Macro(Type, member) to each member */
+#define SGC_LAYOUT_EACH_(Macro, ...)                                           \
+  SGC_LAYOUT_CAT_(SGC_LAYOUT_EACH, SGC_LAYOUT_COUNT_(__VA_ARGS__))             \
+  (Macro, __VA_ARGS__)
+#define SGC_LAYOUT_CAT_(a, b) SGC_LAYOUT_CAT2_(a, b)
+#define SGC_LAYOUT_CAT2_(a, b) a##b
+#define SGC_LAYOUT_COUNT_(...)                                                 \
+  SGC_LAYOUT_NTH_(__VA_ARGS__, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, \
+                  1, 0, 0)
+#define SGC_LAYOUT_NTH_(t, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12,  \
+                        _13, _14, _15, n, ...)                                 \
+  n
+#define SGC_LAYOUT_EACH0(M, T)
+#define SGC_LAYOUT_EACH1(M, T, a) M(T, a)
+#define SGC_LAYOUT_EACH2(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH1(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH3(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH2(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH4(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH3(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH5(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH4(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH6(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH5(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH7(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH6(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH8(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH7(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH9(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH8(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH10(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH9(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH11(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH10(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH12(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH11(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH13(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH12(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH14(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH13(M, T, __VA_ARGS__)
+#define SGC_LAYOUT_EACH15(M, T, a, ...) M(T, a) SGC_LAYOUT_EACH14(M, T, __VA_ARGS__)
+
+/**
+ * Allocate a Type with gc_new() and record the current file and line as
+ * its allocation site (up to 15 constructor arguments):
+ *   sgc::gc_ptr<Node> node = SGC_NEW(Node, 1, nullptr, nullptr);
+ */
+#define SGC_NEW(...)                                                           \
+  sgc::gc_new_at<SGC_LAYOUT_TYPE_(__VA_ARGS__, 0)>(                            \
+      __FILE__, __LINE__ SGC_LAYOUT_EACH_(SGC_NEW_ARGUMENT_, __VA_ARGS__))
+#define SGC_NEW_ARGUMENT_(Type, argument) , argument
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdio.h>
+
+#include "../src/sgc.h"
+
+void *mappings[2]; /* in the BSS, so they're scanned */
+uintptr_t freedMapping;
+
+/**
+ * Allocate memory and return an integer that points into it, but not at its
+ * beginning. So it's a false pointer that doesn't retain the memory.
+ */
+uintptr_t falsePointer() {
+  char *p = sgc_malloc(64);
+  return (uintptr_t)p + 8;
+}
+
+int main() {
+  sgc_init();
+
+  uintptr_t integer = falsePointer();
+  sgc_collect();
+
+  /* malloc() would usually hand out the just freed memory again */
+  void *p = sgc_malloc(64);
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  printf("false pointers: %lu, blacklisted pages: %lu, held back: %lu bytes\n",
+         stats.falsePointers, stats.blacklistedPages, stats.blacklistedBytes);
+
+  int ok = ((uintptr_t)p >> BLACKLIST_PAGE_SHIFT) !=
+           (integer >> BLACKLIST_PAGE_SHIFT);
+  printf("allocation avoided blacklisted page: %s\n", ok ? "yes" : "no");
+
+  /* held back memory doesn't stay forever, even if its page does */
+  for (int i = 0; i < BLACKLIST_HOLD_COLLECTIONS; i++)
+    sgc_collect();
+  sgc_get_stats(&stats);
+  int released = stats.blacklistedBytes == 0 &&
+                 ((uintptr_t)p >> BLACKLIST_PAGE_SHIFT) != 0 && integer != 0;
+  printf("held back memory released: %s\n", released ? "yes" : "no");
+  ok &= released;
+
+  /* a mapping on a blacklisted page is replaced instead of held back, the
+   * gap between two mappings is where the next one usually goes */
+  mappings[0] = sgc_malloc(LARGE_ALLOCATION_SIZE);
+  void *gap = sgc_malloc(LARGE_ALLOCATION_SIZE);
+  mappings[1] = sgc_malloc(LARGE_ALLOCATION_SIZE);
+  freedMapping = (uintptr_t)gap + 8;
+  sgc_free(gap);
+  gap = NULL;
+  sgc_collect();
+  void *q = sgc_malloc(LARGE_ALLOCATION_SIZE);
+  sgc_get_stats(&stats);
+  int remapped = q != NULL && stats.blacklistedBytes == 0 &&
+                 ((uintptr_t)q >> BLACKLIST_PAGE_SHIFT) !=
+                     (freedMapping >> BLACKLIST_PAGE_SHIFT);
+  printf("mapping avoided blacklisted page without holding: %s\n",
+         remapped ? "yes" : "no");
+  ok &= remapped;
+
+  sgc_exit();
+  return !ok;
+}
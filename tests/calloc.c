@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/sgc.h"
+
+#define SMALL_SIZE 256
+#define LARGE_SIZE (1024 * 1024)
+#define TARGET_SIZE (100 * 1024) /* not mapped */
+
+void *kept[2];    /* in the BSS, so it's scanned */
+void *reused[10]; /* allocations that may get freed memory */
+void *target;     /* referenced from freed memory */
+void **moved;     /* reallocated, no longer referencing target */
+
+static int isZero(const char *memory, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (memory[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+static size_t bytesAllocated() {
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  return stats.bytesAllocated;
+}
+
+/**
+ * Leave a pointer to target in an allocation that becomes garbage.
+ */
+__attribute__((noinline)) static void leaveStalePointer() {
+  void **garbage = sgc_malloc(SMALL_SIZE);
+  memset(garbage, 0, SMALL_SIZE);
+  garbage[SMALL_SIZE / sizeof(void *) - 1] = target;
+}
+
+/**
+ * Leave a pointer to target in memory sgc_realloc() moves away from.
+ */
+__attribute__((noinline)) static void moveStalePointer(size_t newSize) {
+  void **holder = sgc_malloc(SMALL_SIZE);
+  memset(holder, 0, SMALL_SIZE);
+  holder[SMALL_SIZE / sizeof(void *) - 1] = target;
+  moved = sgc_realloc(holder, newSize);
+  moved[SMALL_SIZE / sizeof(void *) - 1] = NULL;
+}
+
+/**
+ * Leave a pointer to target in a region that ends.
+ */
+__attribute__((noinline)) static void leaveRegionPointer() {
+  sgc_region_begin();
+  void **inRegion = sgc_malloc(SMALL_SIZE / 2);
+  memset(inRegion, 0, SMALL_SIZE / 2);
+  inRegion[SMALL_SIZE / 2 / sizeof(void *) - 1] = target;
+  sgc_region_end();
+}
+
+/**
+ * Overwrite the unused part of the stack, so no stale pointer is left.
+ */
+__attribute__((noinline)) static void clearStack() {
+  volatile char buffer[16384];
+  memset((char *)buffer, 0, sizeof(buffer));
+}
+
+int main() {
+  sgc_init();
+  int ok = 1;
+
+  /* dirty some memory, so calloc() can't rely on fresh memory only */
+  for (int i = 0; i < 100; i++)
+    memset(sgc_malloc(SMALL_SIZE), 0xff, SMALL_SIZE);
+  sgc_collect();
+  char *small = sgc_calloc(SMALL_SIZE / 4, 4);
+  char *large = sgc_calloc(1, LARGE_SIZE);
+  ok &= small != NULL && isZero(small, SMALL_SIZE);
+  ok &= large != NULL && isZero(large, LARGE_SIZE);
+  printf("calloc() memory is zero: %s\n", ok ? "yes" : "no");
+  ok &= sgc_calloc(SIZE_MAX / 2, 4) == NULL;
+
+  /* reallocating into and within mappings keeps the content */
+  memset(small, 1, SMALL_SIZE);
+  memset(large, 2, LARGE_SIZE);
+  kept[0] = small = sgc_realloc(small, LARGE_SIZE);
+  kept[1] = large = sgc_realloc(large, 4 * LARGE_SIZE);
+  int same = small != NULL && large != NULL && small[SMALL_SIZE - 1] == 1 &&
+             large[0] == 2 && large[LARGE_SIZE - 1] == 2;
+  printf("reallocation kept the content: %s\n", same ? "yes" : "no");
+  ok &= same;
+
+  /* freed memory reused by sgc_malloc() doesn't retain anything */
+  sgc_set_zero_on_free(1);
+  target = sgc_malloc(LARGE_SIZE);
+  leaveStalePointer();
+  clearStack();
+  sgc_collect(); /* frees the garbage, but not target */
+  for (int i = 0; i < 10; i++)
+    reused[i] = sgc_malloc(SMALL_SIZE);
+  size_t before = bytesAllocated();
+  target = NULL;
+  clearStack();
+  sgc_collect();
+  int freed = bytesAllocated() <= before - LARGE_SIZE;
+  printf("stale pointers were cleared: %s\n", freed ? "yes" : "no");
+  ok &= freed;
+
+  /* neither does memory sgc_realloc() moved away from */
+  size_t newSizes[] = {4096, LARGE_SIZE};
+  for (int i = 0; i < 2; i++) {
+    target = sgc_malloc(TARGET_SIZE);
+    moveStalePointer(newSizes[i]);
+    for (int j = 0; j < 10; j++)
+      reused[j] = sgc_malloc(SMALL_SIZE);
+    clearStack();
+    sgc_collect(); /* only target can be freed below */
+    before = bytesAllocated();
+    target = NULL;
+    clearStack();
+    sgc_collect();
+    freed = bytesAllocated() <= before - TARGET_SIZE;
+    printf("stale pointers were cleared after moving to %lu bytes: %s\n",
+           (unsigned long)newSizes[i], freed ? "yes" : "no");
+    ok &= freed;
+  }
+
+  /* neither does memory of a region that ended */
+  target = sgc_malloc(TARGET_SIZE);
+  leaveRegionPointer();
+  reused[0] = sgc_malloc(REGION_CHUNK_SIZE); /* most likely the chunk */
+  clearStack();
+  sgc_collect();
+  before = bytesAllocated();
+  target = NULL;
+  clearStack();
+  sgc_collect();
+  freed = bytesAllocated() <= before - TARGET_SIZE;
+  printf("stale pointers were cleared when the region ended: %s\n",
+         freed ? "yes" : "no");
+  ok &= freed;
+
+  sgc_exit();
+  return !ok;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "../src/sgc.h"
+
+#define COROUTINE_STACK_SIZE (64 * 1024)
+#define GUARD_SIZE 4096
+
+/* not in the data segment, so saved registers aren't found there */
+ucontext_t *mainContext, *coroutineContext;
+SGC_Stack *coroutineStack;
+int ok = 1;
+
+/**
+ * Suspend the coroutine and continue in main().
+ */
+void yield() {
+  sgc_stack_switch(NULL);
+  swapcontext(coroutineContext, mainContext);
+}
+
+/**
+ * Keep managed memory referenced only from the coroutine stack while
+ * main() collects garbage.
+ */
+void coroutine() {
+  int *numbers = sgc_malloc(100 * sizeof(int));
+  for (int i = 0; i < 100; i++)
+    numbers[i] = i;
+  yield();
+  for (int i = 0; i < 100; i++)
+    ok &= numbers[i] == i;
+}
+
+int main() {
+  sgc_init();
+
+  /* the stack is surrounded by guard pages, so reading beyond it crashes */
+  char *mapping = mmap(NULL, COROUTINE_STACK_SIZE + 2 * GUARD_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void *stackMemory = mapping + GUARD_SIZE;
+  if (mapping == MAP_FAILED ||
+      mprotect(stackMemory, COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE)) {
+    printf("mapping the stack failed\n");
+    return 1;
+  }
+  coroutineStack = sgc_stack_register(stackMemory, COROUTINE_STACK_SIZE);
+  mainContext = malloc(sizeof(ucontext_t));
+  coroutineContext = malloc(sizeof(ucontext_t));
+  getcontext(coroutineContext);
+  coroutineContext->uc_stack.ss_sp = stackMemory;
+  coroutineContext->uc_stack.ss_size = COROUTINE_STACK_SIZE;
+  coroutineContext->uc_link = mainContext;
+  makecontext(coroutineContext, coroutine, 0);
+
+  sgc_stack_switch(coroutineStack);
+  swapcontext(mainContext, coroutineContext);
+
+  /* the coroutine is suspended, produce garbage and collect */
+  for (int i = 0; i < 1000; i++) {
+    void *garbage = sgc_malloc(400);
+    (void)garbage;
+  }
+  sgc_collect();
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  ok &= stats.bytesAllocated >= 100 * sizeof(int);
+
+  /* resume it, it returns to main() through uc_link when it's done, so
+   * SGC still thinks the coroutine stack is in use */
+  sgc_stack_switch(coroutineStack);
+  swapcontext(mainContext, coroutineContext);
+  sgc_collect();
+  /* the main stack's top must not be taken as the coroutine stack's */
+  sgc_stack_switch(NULL);
+  sgc_collect();
+
+  sgc_stack_unregister(coroutineStack);
+  munmap(mapping, COROUTINE_STACK_SIZE + 2 * GUARD_SIZE);
+  free(coroutineContext);
+  free(mainContext);
+
+  printf("memory on coroutine stack survived: %s\n", ok ? "yes" : "no");
+  sgc_exit();
+  return !ok;
+}
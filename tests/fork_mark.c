@@ -0,0 +1,65 @@
+#include <signal.h>
+#include <stdio.h>
+
+#include "../src/sgc.h"
+
+typedef struct Node {
+  struct Node *next;
+  int value;
+} Node;
+
+/**
+ * Allocate garbage while a list is kept alive, and check that the list
+ * survives the collections done by forked children.
+ */
+int main() {
+  sgc_init();
+  sgc_set_mode(SGC_MODE_FORK);
+
+  Node *list = NULL;
+  for (int i = 0; i < 100000; i++) {
+    void *garbage = sgc_malloc(64);
+    (void)garbage;
+    if (i % 100 == 0) {
+      Node *node = sgc_malloc(sizeof(Node));
+      node->value = i;
+      node->next = list;
+      list = node;
+    }
+  }
+  sgc_collect();
+
+  int ok = 1;
+  int expected = 99900;
+  for (Node *node = list; node != NULL; node = node->next) {
+    ok &= node->value == expected;
+    expected -= 100;
+  }
+  ok &= expected == -100;
+
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  printf("collections: %lu, bytes allocated: %lu\n", stats.collections,
+         stats.bytesAllocated);
+  printf("list intact: %s\n", ok ? "yes" : "no");
+
+  /* children reaped by the system still deliver their result */
+  signal(SIGCHLD, SIG_IGN);
+  size_t peak = 0;
+  for (int i = 0; i < 100000; i++) {
+    void *garbage = sgc_malloc(64);
+    (void)garbage;
+    if (i % 1000 == 0) {
+      sgc_get_stats(&stats);
+      if (stats.bytesAllocated > peak)
+        peak = stats.bytesAllocated;
+    }
+  }
+  int freed = peak < 100000 * 64 / 2;
+  printf("garbage freed with SIGCHLD ignored: %s (peak %lu bytes)\n",
+         freed ? "yes" : "no", (unsigned long)peak);
+  ok &= freed;
+
+  sgc_exit();
+  return !ok;
+}
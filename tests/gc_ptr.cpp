@@ -0,0 +1,126 @@
+/**
+ * Use the collector from C++ with precise layouts.
+ * Compile with:
+ *   gcc -c -o sgc.o src/sgc.c
+ *   g++ -o gc_ptr tests/gc_ptr.cpp sgc.o
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../src/sgc.hpp"
+
+struct Node {
+  int value;
+  sgc::gc_ptr<Node> left;
+  sgc::gc_ptr<Node> right;
+
+  Node(int value, sgc::gc_ptr<Node> left, sgc::gc_ptr<Node> right)
+      : value(value), left(left), right(right) {}
+};
+SGC_LAYOUT(Node, left, right)
+
+struct Blob {
+  char data[1 << 20];
+};
+SGC_LAYOUT(Blob)
+
+using Numbers = std::vector<uintptr_t, sgc::allocator<uintptr_t>>;
+using Nodes = std::vector<sgc::gc_ptr<Node>, sgc::allocator<sgc::gc_ptr<Node>>>;
+
+static size_t bytesAllocated() {
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  return stats.bytesAllocated;
+}
+
+/**
+ * Build a complete binary tree of the given depth.
+ */
+static sgc::gc_ptr<Node> buildTree(int depth) {
+  if (depth == 0)
+    return nullptr;
+  return SGC_NEW(Node, depth, buildTree(depth - 1), buildTree(depth - 1));
+}
+
+static int sumTree(sgc::gc_ptr<Node> node) {
+  if (!node)
+    return 0;
+  return node->value + sumTree(node->left) + sumTree(node->right);
+}
+
+/**
+ * Allocate a blob and only keep its address as a number.
+ */
+__attribute__((noinline)) static void keepAddress(Numbers &numbers) {
+  numbers.push_back(reinterpret_cast<uintptr_t>(SGC_NEW(Blob).get()));
+}
+
+/**
+ * Overwrite the unused part of the stack, so no stale pointer is left.
+ */
+__attribute__((noinline)) static void clearStack() {
+  volatile char buffer[16384];
+  memset((char *)buffer, 0, sizeof(buffer));
+}
+
+/**
+ * Containers free their memory when destroyed, so they have to be gone
+ * before sgc_exit().
+ */
+static int run() {
+  /* objects reachable through gc_ptr fields survive */
+  sgc::gc_ptr<Node> tree = buildTree(12);
+  int expected = sumTree(tree);
+  for (int i = 0; i < 10; i++) {
+    buildTree(8); /* garbage */
+    sgc_collect();
+  }
+  if (sumTree(tree) != expected) {
+    printf("tree was corrupted\n");
+    return 1;
+  }
+
+  /* containers reallocate through sgc::allocator */
+  Nodes nodes;
+  for (int i = 0; i < 10000; i++) {
+    nodes.push_back(sgc::gc_new<Node>(i, nullptr, nullptr));
+    if (i % 1000 == 0)
+      sgc_collect();
+  }
+  sgc_collect();
+  for (int i = 0; i < 10000; i++) {
+    if (nodes[i]->value != i) {
+      printf("node %d was corrupted\n", i);
+      return 1;
+    }
+  }
+
+  /* numbers looking like pointers don't keep anything alive */
+  Numbers numbers;
+  numbers.reserve(16);
+  keepAddress(numbers);
+  clearStack();
+  sgc_collect();
+  size_t before = bytesAllocated();
+  nodes.clear();
+  nodes.shrink_to_fit();
+  tree = nullptr;
+  clearStack();
+  sgc_collect();
+  if (bytesAllocated() >= before || bytesAllocated() > sizeof(Blob) / 2) {
+    printf("memory retained: %lu bytes\n", (unsigned long)bytesAllocated());
+    return 1;
+  }
+  printf("precise: %lu bytes left\n", (unsigned long)bytesAllocated());
+  return 0;
+}
+
+int main() {
+  sgc_init();
+  int result = run();
+  sgc_exit();
+  return result;
+}
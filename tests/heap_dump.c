@@ -0,0 +1,66 @@
+/**
+ * Dump the heap to heap.dump.
+ * Compile with -DSGC_PROFILE to record allocation sites:
+ *   gcc -DSGC_PROFILE -o heap_dump tests/heap_dump.c src/sgc.c
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../src/sgc.h"
+
+typedef struct Node {
+  struct Node *next;
+  char payload[100];
+} Node;
+
+uintptr_t inside[100]; /* false pointers into the nodes, found in the BSS */
+
+/**
+ * Build a linked list of count nodes, every node with a buffer.
+ */
+Node *buildList(int count) {
+  Node *head = NULL;
+  for (int i = 0; i < count; i++) {
+    Node *node = sgc_malloc(sizeof(Node));
+    node->next = head;
+    head = node;
+  }
+  return head;
+}
+
+int main() {
+  sgc_init();
+#ifdef SGC_PROFILE
+  sgc_set_sample_rate(1);
+#endif
+
+  Node *list = buildList(100);
+  void *buffer = sgc_malloc(5000);
+  int i = 0;
+  for (Node *node = list; node != NULL; node = node->next)
+    inside[i++] = (uintptr_t)node->payload;
+
+  SGC_Stats before, after;
+  sgc_collect();
+  sgc_get_stats(&before);
+  int fd = open("heap.dump", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || sgc_dump_heap(fd) != 0) {
+    printf("dumping the heap failed\n");
+    return 1;
+  }
+  close(fd);
+  printf("heap dumped to heap.dump, analyze it with tools/heapstat.c\n");
+
+  /* finding the roots again doesn't count false pointers twice */
+  sgc_get_stats(&after);
+  if (after.falsePointers >= before.falsePointers + 100) {
+    printf("false pointers counted twice: %lu, before %lu\n",
+           (unsigned long)after.falsePointers,
+           (unsigned long)before.falsePointers);
+    return 1;
+  }
+
+  sgc_exit();
+  return list == NULL || buffer == NULL;
+}
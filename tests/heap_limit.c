@@ -0,0 +1,51 @@
+#include <stdio.h>
+
+#include "../src/sgc.h"
+
+#define BLOCK_SIZE 1024
+#define HARD_LIMIT (256 * 1024)
+
+void *kept[1000]; /* in the BSS, so it's scanned */
+
+int main() {
+  sgc_init();
+  sgc_set_heap_limit(HARD_LIMIT / 2, HARD_LIMIT);
+
+  /* garbage never hits the limit, it's collected before */
+  int ok = 1;
+  for (int i = 0; i < 10000; i++) {
+    ok &= sgc_malloc(BLOCK_SIZE) != NULL;
+  }
+  printf("garbage allocations succeeded: %s\n", ok ? "yes" : "no");
+
+  /* memory that is kept alive can't exceed the hard limit */
+  int count = 0;
+  while (count < 1000 && (kept[count] = sgc_malloc(BLOCK_SIZE)) != NULL)
+    count++;
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  printf("kept %d blocks before an allocation failed (%lu bytes, %lu "
+         "emergency collections)\n",
+         count, stats.bytesAllocated, stats.emergencyCollections);
+  ok &= count < 1000 && count > 0 && stats.bytesAllocated <= HARD_LIMIT;
+
+  /* region chunks can't exceed the hard limit either */
+  for (int i = 0; i < count; i++)
+    kept[i] = NULL;
+  sgc_region_begin();
+  size_t regionCount = 0;
+  while (regionCount < 100000 && sgc_malloc(BLOCK_SIZE) != NULL)
+    regionCount++;
+  sgc_get_stats(&stats);
+  printf("allocated %lu blocks in a region before an allocation failed "
+         "(%lu bytes of chunks)\n",
+         regionCount, stats.regionBytes);
+  ok &= regionCount < 100000 && regionCount > 0 &&
+        stats.bytesAllocated + stats.regionBytes <= HARD_LIMIT;
+  sgc_region_end();
+  sgc_get_stats(&stats);
+  ok &= stats.regionBytes == 0;
+
+  sgc_exit();
+  return !ok;
+}
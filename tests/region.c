@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/sgc.h"
+
+typedef struct {
+  int *shared; /* managed memory allocated before the region */
+  char name[32];
+} Request;
+
+/**
+ * Allocate managed memory and return a pointer to it in a region
+ * allocation, so the region is the only one referencing it.
+ */
+Request *newRequest() {
+  int *shared = sgc_malloc(1000 * sizeof(int));
+  shared[0] = 42;
+  sgc_region_begin();
+  Request *request = sgc_malloc(sizeof(Request));
+  request->shared = shared;
+  return request;
+}
+
+int main() {
+  sgc_init();
+
+  Request *request = newRequest();
+  for (int i = 0; i < 10000; i++) {
+    char *buffer = sgc_malloc(100);
+    buffer = sgc_realloc(buffer, 200);
+    strcpy(buffer, "temporary");
+    sgc_free(buffer);
+  }
+  strcpy(request->name, "request");
+
+  /* sizes that overflow when rounded up fail */
+  void *small = sgc_malloc(16);
+  int failed =
+      sgc_malloc(SIZE_MAX) == NULL && sgc_realloc(small, SIZE_MAX) == NULL;
+  printf("huge allocations fail: %s\n", failed ? "yes" : "no");
+
+  /* reallocating to a size that fits does nothing, growing copies the
+   * allocation only */
+  char *first = sgc_malloc(64);
+  char *second = sgc_malloc(64);
+  memset(first, 'a', 64);
+  memset(second, 'b', 64);
+  int fits = sgc_realloc(first, 32) == first && sgc_realloc(first, 64) == first;
+  char *grown = sgc_realloc(first, 128);
+  int copied = grown != NULL && grown[0] == 'a' && grown[63] == 'a' &&
+               second[0] == 'b' && sgc_realloc(grown, 128) == grown;
+  printf("region reallocation keeps fitting memory: %s\n",
+         fits && copied ? "yes" : "no");
+  failed &= fits && copied;
+
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  size_t before = stats.bytesAllocated;
+  sgc_collect();
+  sgc_get_stats(&stats);
+  int ok = stats.bytesAllocated == before && request->shared[0] == 42;
+  printf("region keeps managed memory alive: %s\n", ok ? "yes" : "no");
+
+  sgc_region_end();
+  request = NULL;
+  sgc_collect();
+  sgc_get_stats(&stats);
+  printf("freed after region end: %s\n",
+         stats.bytesAllocated == 0 ? "yes" : "no");
+  ok &= stats.bytesAllocated == 0 && failed;
+
+  void *p = sgc_malloc(123);
+  sgc_free(p);
+  sgc_get_stats(&stats);
+  ok &= stats.bytesAllocated == 0;
+
+  sgc_exit();
+  return !ok;
+}
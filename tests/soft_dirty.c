@@ -0,0 +1,63 @@
+#include <stdio.h>
+
+#include "../src/sgc.h"
+
+typedef struct Node {
+  struct Node *next;
+  int value;
+} Node;
+
+Node *lists[2] = {NULL, NULL};
+
+/**
+ * Allocate garbage while nodes keep moving between two lists, so the
+ * marker thread sees outdated pointers, and check that no node gets lost.
+ * If the kernel doesn't track soft-dirty pages, the collector falls back to
+ * stop-the-world and only that is tested.
+ * Compile with -pthread.
+ */
+int main() {
+  sgc_init();
+  sgc_set_mode(SGC_MODE_SOFT_DIRTY);
+
+  long expected = 0;
+  for (int i = 0; i < 200000; i++) {
+    void *garbage = sgc_malloc(64);
+    (void)garbage;
+    if (i % 100 == 0) {
+      Node *node = sgc_malloc(sizeof(Node));
+      node->value = i;
+      node->next = lists[0];
+      lists[0] = node;
+      expected += i;
+    }
+    /* move the first node of one list to the other one */
+    int from = i % 2;
+    Node *node = lists[from];
+    if (node != NULL) {
+      lists[from] = node->next;
+      node->next = lists[!from];
+      lists[!from] = node;
+    }
+  }
+  int concurrent = sgc_get_mode() == SGC_MODE_SOFT_DIRTY;
+  sgc_collect();
+
+  long sum = 0;
+  for (int l = 0; l < 2; l++) {
+    for (Node *node = lists[l]; node != NULL; node = node->next)
+      sum += node->value;
+  }
+
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  printf("collections: %lu, bytes allocated: %lu\n", stats.collections,
+         stats.bytesAllocated);
+  printf("lists intact: %s\n", sum == expected ? "yes" : "no");
+  if (!concurrent)
+    printf("concurrent marking skipped: soft-dirty pages not supported, "
+           "stop-the-world was used\n");
+
+  sgc_exit();
+  return sum != expected;
+}
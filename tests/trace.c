@@ -0,0 +1,113 @@
+/**
+ * Record an allocation trace to alloc.trace and check its events.
+ * Replay it with tools/replay.c:
+ *   gcc -o replay tools/replay.c src/sgc.c
+ *   ./replay alloc.trace
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/sgc.h"
+
+typedef struct Node {
+  struct Node *next;
+  char payload[100];
+} Node;
+
+Node *list = NULL;
+
+/**
+ * Read unsigned LEB128 value, -1 at the end of the file.
+ */
+static int64_t readVarint(FILE *file) {
+  uint64_t value = 0;
+  int shift = 0;
+  int byte;
+  do {
+    byte = fgetc(file);
+    if (byte == EOF)
+      return -1;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+int main() {
+  sgc_init();
+
+  int fd = open("alloc.trace", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || sgc_trace_start(fd) != 0) {
+    printf("starting the trace failed\n");
+    return 1;
+  }
+  /* keep every second node in the list, drop the others */
+  for (int i = 0; i < 20000; i++) {
+    Node *node = sgc_malloc(sizeof(Node));
+    if (i % 2 == 0) {
+      node->next = list;
+      list = node;
+    }
+  }
+  void *buffer = sgc_malloc(16);
+  buffer = sgc_realloc(buffer, 100000);
+  sgc_free(buffer);
+  if (sgc_trace_stop() != 0) {
+    printf("writing the trace failed\n");
+    return 1;
+  }
+  close(fd);
+
+  /* count the events */
+  FILE *file = fopen("alloc.trace", "rb");
+  char magic[4];
+  if (file == NULL || fread(magic, 1, 4, file) != 4 ||
+      memcmp(magic, "SGCT", 4) != 0 || readVarint(file) != 1) {
+    printf("invalid trace header\n");
+    return 1;
+  }
+  int counts[256] = {0};
+  int inCollection = 0, listEdges = 0;
+  int tag;
+  while ((tag = fgetc(file)) != EOF) {
+    counts[tag]++;
+    int values = tag == 'M'                ? 2
+                 : tag == 'R' || tag == 'e' ? 3
+                 : tag == 'C'               ? 0
+                                            : 1;
+    int64_t offset = 0;
+    for (int i = 0; i < values; i++) {
+      int64_t value = readVarint(file);
+      if (value < 0) {
+        printf("truncated event '%c'\n", tag);
+        return 1;
+      }
+      if (tag == 'e' && i == 1)
+        offset = value;
+    }
+    if (tag == 'e' && offset == 0)
+      listEdges++;
+    if (tag == 'C')
+      inCollection = 1;
+    if (tag == 'c')
+      inCollection = 0;
+    if (tag == 'F' && !inCollection)
+      counts['f']++;
+  }
+  fclose(file);
+
+  printf("%d mallocs, %d reallocs, %d frees, %d collections, %d edges\n",
+         counts['M'], counts['R'], counts['F'], counts['C'], counts['e']);
+  if (counts['M'] != 20001 || counts['R'] != 1 || counts['C'] == 0 ||
+      counts['C'] != counts['c'] || counts['f'] != 1 || listEdges == 0 ||
+      counts['F'] < 1000) {
+    printf("unexpected events\n");
+    return 1;
+  }
+
+  sgc_exit();
+  return 0;
+}
@@ -0,0 +1,464 @@
+/**
+ * Aggregate a heap dump written by sgc_dump_heap() per allocation site.
+ *
+ * For every site the number of live allocations, their size (shallow) and
+ * the memory that would be freed if all of them were unreachable (retained)
+ * is printed. The retained size is computed with the dominator tree of the
+ * reference graph: an allocation retains everything it dominates.
+ *
+ * If only every n-th allocation was sampled, the numbers of the sampled
+ * sites are multiplied by n and "<not sampled>" only keeps what's left.
+ * These are estimates: the retained size of a site is scaled too (capped at
+ * the total size), which overestimates it if its allocations retain each
+ * other (e.g. the nodes of a linked list).
+ *
+ * Compile and use:
+ *   gcc -o heapstat tools/heapstat.c
+ *   ./heapstat heap.dump
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * One allocation of the dump.
+ */
+typedef struct {
+  uint64_t address;  /**< address of the allocation */
+  uint64_t size;     /**< size of the allocation */
+  int root;          /**< referenced from a root */
+  int site;          /**< index into sites */
+  int refsBegin;     /**< first reference in refs */
+  int refsCount;     /**< number of references */
+  uint64_t retained; /**< retained size */
+} Object;
+
+/**
+ * Aggregated information about an allocation site.
+ */
+typedef struct {
+  char *name;        /**< "file:line" or "<not sampled>" */
+  uint64_t count;    /**< number of live allocations */
+  uint64_t shallow;  /**< sum of their sizes */
+  uint64_t retained; /**< memory retained by them */
+  int active;        /**< used during dominator tree traversal */
+} Site;
+
+static Object *objects = NULL;
+static int objectCount = 0;
+static uint64_t *refs = NULL; /* addresses first, indices after resolving */
+static int refsCount = 0;
+static Site *sites = NULL;
+static int siteCount = 0;
+static uint64_t sampleRate = 1; /* every n-th allocation was sampled */
+
+/**
+ * Grow array to hold at least count + 1 elements of size elementSize.
+ */
+static void *reserve(void *array, int count, size_t elementSize) {
+  if ((count & (count - 1)) == 0) { /* count is 0 or a power of two */
+    array = realloc(array, (count == 0 ? 8 : count * 2) * elementSize);
+    if (array == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  return array;
+}
+
+/**
+ * Read unsigned LEB128 value.
+ */
+static uint64_t readVarint(FILE *file) {
+  uint64_t value = 0;
+  int shift = 0;
+  int byte;
+  do {
+    byte = fgetc(file);
+    if (byte == EOF) {
+      fprintf(stderr, "unexpected end of file\n");
+      exit(1);
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+/**
+ * Get index of site with name, add it if it doesn't exist yet.
+ * Sites are looked up linearly, but the last one is checked first since
+ * allocations of the same site are often next to each other.
+ */
+static int findSite(const char *name) {
+  static int last = -1;
+  if (last >= 0 && strcmp(sites[last].name, name) == 0)
+    return last;
+  for (int i = 0; i < siteCount; i++) {
+    if (strcmp(sites[i].name, name) == 0)
+      return last = i;
+  }
+  sites = reserve(sites, siteCount, sizeof(Site));
+  Site *site = &sites[siteCount];
+  site->name = strdup(name);
+  site->count = site->shallow = site->retained = 0;
+  site->active = 0;
+  return last = siteCount++;
+}
+
+static void readDump(FILE *file) {
+  char magic[4];
+  uint64_t version = 0;
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "SGCH", 4) != 0 ||
+      ((version = readVarint(file)) != 1 && version != 2)) {
+    fprintf(stderr, "not a sgc heap dump\n");
+    exit(1);
+  }
+  /* version 1 didn't record the sample rate */
+  if (version >= 2)
+    sampleRate = readVarint(file);
+  if (sampleRate == 0)
+    sampleRate = 1;
+  int tag;
+  while ((tag = fgetc(file)) == 'O') {
+    objects = reserve(objects, objectCount, sizeof(Object));
+    Object *object = &objects[objectCount++];
+    object->address = readVarint(file);
+    object->size = readVarint(file);
+    object->root = readVarint(file) & 1;
+    uint64_t line = readVarint(file);
+    uint64_t fileLength = readVarint(file);
+    char name[4096 + 32] = "<not sampled>";
+    if (fileLength > 0) {
+      char path[4096];
+      if (fileLength >= sizeof(path) ||
+          fread(path, 1, fileLength, file) != fileLength) {
+        fprintf(stderr, "invalid allocation site\n");
+        exit(1);
+      }
+      path[fileLength] = '\0';
+      snprintf(name, sizeof(name), "%s:%lu", path, (unsigned long)line);
+    }
+    object->site = findSite(name);
+    object->refsBegin = refsCount;
+    object->refsCount = readVarint(file);
+    for (int i = 0; i < object->refsCount; i++) {
+      refs = reserve(refs, refsCount, sizeof(uint64_t));
+      refs[refsCount++] = readVarint(file);
+    }
+  }
+  if (tag != 'E') {
+    fprintf(stderr, "unexpected end of file\n");
+    exit(1);
+  }
+}
+
+static int compareAddress(const void *a, const void *b) {
+  const Object *x = a, *y = b;
+  return x->address < y->address ? -1 : x->address > y->address;
+}
+
+/**
+ * Sort objects by address and replace reference addresses by indices.
+ */
+static void resolveReferences() {
+  qsort(objects, objectCount, sizeof(Object), compareAddress);
+  for (int i = 0; i < refsCount; i++) {
+    Object key = {.address = refs[i]};
+    Object *target =
+        bsearch(&key, objects, objectCount, sizeof(Object), compareAddress);
+    /* every reference was to a live allocation when dumping */
+    refs[i] = target != NULL ? (uint64_t)(target - objects) : UINT64_MAX;
+  }
+}
+
+/* The reference graph has one node per allocation and a virtual root node
+ * (index objectCount). The virtual root references all allocations that are
+ * referenced from roots or not referenced at all (e.g. because the only
+ * reference was in a register), and one allocation of every cycle that isn't
+ * reachable otherwise. Per node (including the virtual root): */
+static char *fromRoot = NULL;  /* referenced by the virtual root */
+static int *order = NULL;      /* position in reverse postorder */
+static int *postorder = NULL;  /* nodes in postorder, virtual root last */
+static int *idom = NULL;       /* immediate dominator, -1 if not known yet */
+static int *predecessors = NULL;
+static int *predecessorsBegin = NULL; /* predecessors of n start here */
+
+/**
+ * Get the next successor of node that wasn't visited yet.
+ * @param   node node to get the successor of
+ * @param   next per node position of the next successor to check
+ * @return  the successor or -1 if there is none left
+ */
+static int nextSuccessor(int node, int *next) {
+  if (node == objectCount) {
+    /* first everything referenced from roots, then everything else that
+     * wasn't visited so far */
+    while (next[node] < 2 * objectCount) {
+      int i = next[node] % objectCount;
+      int everything = next[node]++ >= objectCount;
+      if (order[i] == -1 && (fromRoot[i] || everything)) {
+        fromRoot[i] = 1;
+        return i;
+      }
+    }
+    return -1;
+  }
+  Object *object = &objects[node];
+  while (next[node] < object->refsCount) {
+    uint64_t i = refs[object->refsBegin + next[node]++];
+    if (i != UINT64_MAX && order[i] == -1)
+      return (int)i;
+  }
+  return -1;
+}
+
+/**
+ * Number the nodes in postorder with an iterative depth first search from
+ * the virtual root.
+ */
+static void numberNodes() {
+  int nodes = objectCount + 1;
+  int *stack = malloc(nodes * sizeof(int));
+  int *next = calloc(nodes, sizeof(int));
+  int count = 0, top = 0;
+
+  stack[top++] = objectCount;
+  order[objectCount] = 0;
+  while (top > 0) {
+    int successor = nextSuccessor(stack[top - 1], next);
+    if (successor >= 0) {
+      order[successor] = 0; /* visited, real number is set below */
+      stack[top++] = successor;
+    } else {
+      postorder[count++] = stack[--top];
+    }
+  }
+  for (int i = 0; i < nodes; i++)
+    order[postorder[i]] = nodes - 1 - i;
+
+  free(stack);
+  free(next);
+}
+
+/**
+ * Build the predecessor lists of all nodes.
+ */
+static void buildPredecessors() {
+  int nodes = objectCount + 1;
+  int *fill = calloc(nodes, sizeof(int));
+  for (int i = 0; i < refsCount; i++) {
+    if (refs[i] != UINT64_MAX)
+      fill[refs[i]]++;
+  }
+  for (int i = 0; i < objectCount; i++)
+    fill[i] += fromRoot[i];
+  for (int i = 0; i < nodes; i++)
+    predecessorsBegin[i + 1] = predecessorsBegin[i] + fill[i];
+  predecessors = malloc((predecessorsBegin[nodes] + 1) * sizeof(int));
+  memcpy(fill, predecessorsBegin, nodes * sizeof(int));
+  for (int i = 0; i < objectCount; i++) {
+    if (fromRoot[i])
+      predecessors[fill[i]++] = objectCount;
+    for (int j = 0; j < objects[i].refsCount; j++) {
+      uint64_t target = refs[objects[i].refsBegin + j];
+      if (target != UINT64_MAX)
+        predecessors[fill[target]++] = i;
+    }
+  }
+  free(fill);
+}
+
+static int intersect(int a, int b) {
+  while (a != b) {
+    while (order[a] > order[b])
+      a = idom[a];
+    while (order[b] > order[a])
+      b = idom[b];
+  }
+  return a;
+}
+
+/**
+ * Compute the immediate dominators with the iterative algorithm from
+ * Cooper, Harvey and Kennedy: "A Simple, Fast Dominance Algorithm".
+ */
+static void computeDominators() {
+  int nodes = objectCount + 1;
+  fromRoot = calloc(nodes, 1);
+  order = malloc(nodes * sizeof(int));
+  postorder = malloc(nodes * sizeof(int));
+  idom = malloc(nodes * sizeof(int));
+  predecessorsBegin = calloc(nodes + 1, sizeof(int));
+
+  char *referenced = calloc(nodes, 1);
+  for (int i = 0; i < refsCount; i++) {
+    if (refs[i] != UINT64_MAX)
+      referenced[refs[i]] = 1;
+  }
+  for (int i = 0; i < objectCount; i++) {
+    fromRoot[i] = objects[i].root || !referenced[i];
+    order[i] = -1;
+    idom[i] = -1;
+  }
+  free(referenced);
+
+  numberNodes();
+  buildPredecessors();
+
+  idom[objectCount] = objectCount;
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    /* reverse postorder, skipping the virtual root */
+    for (int k = objectCount - 1; k >= 0; k--) {
+      int node = postorder[k];
+      int newIdom = -1;
+      for (int j = predecessorsBegin[node]; j < predecessorsBegin[node + 1];
+           j++) {
+        int p = predecessors[j];
+        if (idom[p] == -1)
+          continue; /* not processed yet */
+        newIdom = newIdom == -1 ? p : intersect(p, newIdom);
+      }
+      if (idom[node] != newIdom) {
+        idom[node] = newIdom;
+        changed = 1;
+      }
+    }
+  }
+}
+
+/**
+ * Compute retained sizes and sum them up per site. A site only gets the
+ * retained size of an allocation if no dominator of it has the same site,
+ * otherwise it would be counted twice (e.g. for linked lists).
+ */
+static void computeRetained() {
+  for (int i = 0; i < objectCount; i++) {
+    Object *object = &objects[i];
+    object->retained = object->size;
+    sites[object->site].count++;
+    sites[object->site].shallow += object->size;
+  }
+  /* dominators come after the nodes they dominate in postorder */
+  for (int k = 0; k < objectCount; k++) {
+    int node = postorder[k];
+    if (idom[node] != objectCount)
+      objects[idom[node]].retained += objects[node].retained;
+  }
+
+  /* build children lists of the dominator tree */
+  int nodes = objectCount + 1;
+  int *childrenBegin = calloc(nodes + 1, sizeof(int));
+  int *children = malloc(nodes * sizeof(int));
+  for (int i = 0; i < objectCount; i++)
+    childrenBegin[idom[i] + 1]++;
+  for (int i = 0; i < nodes; i++)
+    childrenBegin[i + 1] += childrenBegin[i];
+  int *fill = malloc(nodes * sizeof(int));
+  memcpy(fill, childrenBegin, nodes * sizeof(int));
+  for (int i = 0; i < objectCount; i++)
+    children[fill[idom[i]]++] = i;
+
+  /* walk the dominator tree, Site.active counts how many allocations of
+   * the site are on the current path */
+  int *stack = malloc(nodes * sizeof(int));
+  int top = 0;
+  memcpy(fill, childrenBegin, nodes * sizeof(int));
+  stack[top++] = objectCount;
+  while (top > 0) {
+    int node = stack[top - 1];
+    if (fill[node] < childrenBegin[node + 1]) {
+      int child = children[fill[node]++];
+      Site *site = &sites[objects[child].site];
+      if (site->active++ == 0)
+        site->retained += objects[child].retained;
+      stack[top++] = child;
+    } else {
+      top--;
+      if (node != objectCount)
+        sites[objects[node].site].active--;
+    }
+  }
+  free(stack);
+  free(fill);
+  free(children);
+  free(childrenBegin);
+}
+
+/**
+ * Scale the numbers of sampled sites by the sample rate. The allocations
+ * they stand for are in "<not sampled>", so take them from there.
+ * @param   total size of all allocations
+ */
+static void scaleSites(uint64_t total) {
+  if (sampleRate == 1)
+    return;
+  Site *notSampled = NULL;
+  uint64_t count = 0, shallow = 0, retained = 0;
+  for (int i = 0; i < siteCount; i++) {
+    Site *site = &sites[i];
+    if (strcmp(site->name, "<not sampled>") == 0) {
+      notSampled = site;
+      continue;
+    }
+    count += site->count * (sampleRate - 1);
+    shallow += site->shallow * (sampleRate - 1);
+    site->count *= sampleRate;
+    site->shallow *= sampleRate;
+    uint64_t scaled = site->retained * sampleRate;
+    retained += scaled - site->retained;
+    site->retained = scaled < total ? scaled : total;
+  }
+  if (notSampled != NULL) {
+    notSampled->count =
+        notSampled->count > count ? notSampled->count - count : 0;
+    notSampled->shallow =
+        notSampled->shallow > shallow ? notSampled->shallow - shallow : 0;
+    notSampled->retained =
+        notSampled->retained > retained ? notSampled->retained - retained : 0;
+  }
+}
+
+static int compareRetained(const void *a, const void *b) {
+  const Site *x = a, *y = b;
+  return x->retained > y->retained ? -1 : x->retained < y->retained;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s heap.dump\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  readDump(file);
+  fclose(file);
+
+  resolveReferences();
+  computeDominators();
+  computeRetained();
+
+  uint64_t total = 0;
+  for (int i = 0; i < objectCount; i++)
+    total += objects[i].size;
+  scaleSites(total);
+  qsort(sites, siteCount, sizeof(Site), compareRetained);
+  printf("%d allocations, %lu bytes\n", objectCount, (unsigned long)total);
+  if (sampleRate > 1)
+    printf("1 in %lu allocations sampled, sites are scaled estimates\n",
+           (unsigned long)sampleRate);
+  printf("\n");
+  printf("%12s %12s %12s  %s\n", "retained", "shallow", "count", "site");
+  for (int i = 0; i < siteCount; i++) {
+    printf("%12lu %12lu %12lu  %s\n", (unsigned long)sites[i].retained,
+           (unsigned long)sites[i].shallow, (unsigned long)sites[i].count,
+           sites[i].name);
+  }
+  return 0;
+}
@@ -0,0 +1,412 @@
+/**
+ * Replay an allocation trace written by sgc_trace_start() against the
+ * collector and report throughput, pauses and peak memory.
+ *
+ * Every allocation, reallocation and sgc_free() of the trace is executed
+ * again. The references recorded at every collection of the trace are
+ * written into the replayed allocations, so the collector finds the same
+ * objects reachable (plus everything allocated since the last recorded
+ * collection). When it collects is decided by the collector itself, unless
+ * -f is given to collect exactly where the trace did.
+ *
+ * Compile and use, with the tuning parameters to compare (the stack is
+ * found through the frame pointer, so keep it when optimizing):
+ *   gcc -O2 -fno-omit-frame-pointer -DHEAP_GROW_FACTOR=3 \
+ *       -o replay tools/replay.c src/sgc.c
+ *   ./replay [-f] alloc.trace
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../src/sgc.h"
+
+/**
+ * A replayed allocation, found by the address it had in the trace.
+ */
+typedef struct {
+  uint64_t address; /**< address in the trace, 0 if unused, 1 if deleted */
+  void *ptr;        /**< replayed allocation */
+  uint64_t size;    /**< size of the allocation */
+  int root;         /**< index into roots, -1 if it isn't a root */
+  int hasEdges;     /**< references were written into it */
+} Object;
+
+/**
+ * A reference recorded during a collection of the trace.
+ */
+typedef struct {
+  uint64_t source; /**< address of the referencing allocation, 0 for roots */
+  uint64_t offset; /**< where the reference is within source */
+  uint64_t target; /**< address of the referenced allocation */
+} Edge;
+
+static Object *objects = NULL;
+static size_t objectCapacity = 0;
+static size_t objectCount = 0; /* including deleted */
+
+/* managed array referenced from here, so the collector finds the roots */
+static void **roots = NULL;
+static uint64_t *rootAddresses = NULL;
+static size_t rootCount = 0;
+static size_t rootCapacity = 0;
+
+static Edge *edges = NULL;
+static size_t edgeCount = 0;
+static size_t edgeCapacity = 0;
+
+/* results */
+static uint64_t operations = 0;
+static uint64_t operationNs = 0;
+static uint64_t collections = 0;
+static uint64_t pauseTotalNs = 0;
+static uint64_t pauseMaxNs = 0;
+static uint64_t recordedPauseNs = 0;
+static uint64_t recordedCollections = 0;
+static size_t peakBytes = 0;
+
+static void outOfMemory() {
+  fprintf(stderr, "out of memory\n");
+  exit(1);
+}
+
+static uint64_t now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+/**
+ * Read unsigned LEB128 value.
+ */
+static uint64_t readVarint(FILE *file) {
+  uint64_t value = 0;
+  int shift = 0;
+  int byte;
+  do {
+    byte = getc(file);
+    if (byte == EOF) {
+      fprintf(stderr, "unexpected end of file\n");
+      exit(1);
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+/**
+ * Find the object for address in the open addressing hash table, or the
+ * entry where it would be inserted.
+ */
+static Object *findObject(uint64_t address) {
+  size_t mask = objectCapacity - 1;
+  size_t index = (address >> 4) * 0x9e3779b97f4a7c15ull >> 20 & mask;
+  Object *deleted = NULL;
+  while (objects[index].address != 0) {
+    if (objects[index].address == address)
+      return &objects[index];
+    if (objects[index].address == 1 && deleted == NULL)
+      deleted = &objects[index];
+    index = (index + 1) & mask;
+  }
+  return deleted != NULL ? deleted : &objects[index];
+}
+
+/**
+ * Get the object for address, NULL if the trace doesn't know it (allocated
+ * before recording started or in a region).
+ */
+static Object *getObject(uint64_t address) {
+  if (address <= 1)
+    return NULL;
+  Object *object = findObject(address);
+  return object->address == address ? object : NULL;
+}
+
+static void removeRoot(Object *object);
+
+/**
+ * Add an object for address, replacing an existing one.
+ */
+static Object *addObject(uint64_t address, void *ptr, uint64_t size) {
+  if ((objectCount + 1) * 4 > objectCapacity * 3) {
+    Object *old = objects;
+    size_t oldCapacity = objectCapacity;
+    objectCapacity = oldCapacity == 0 ? 1024 : oldCapacity * 2;
+    objects = calloc(objectCapacity, sizeof(Object));
+    if (objects == NULL)
+      outOfMemory();
+    objectCount = 0;
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (old[i].address > 1) {
+        Object *object = findObject(old[i].address);
+        *object = old[i];
+        objectCount++;
+      }
+    }
+    free(old);
+  }
+  Object *object = findObject(address);
+  if (object->address == address) {
+    removeRoot(object);
+  } else if (object->address == 0) {
+    objectCount++;
+  }
+  object->address = address;
+  object->ptr = ptr;
+  object->size = size;
+  object->root = -1;
+  object->hasEdges = 0;
+  return object;
+}
+
+static void addRoot(Object *object) {
+  if (object->root >= 0)
+    return;
+  if (rootCount == rootCapacity) {
+    rootCapacity = rootCapacity == 0 ? 1024 : rootCapacity * 2;
+    roots = sgc_realloc(roots, rootCapacity * sizeof(void *));
+    rootAddresses = realloc(rootAddresses, rootCapacity * sizeof(uint64_t));
+    if (roots == NULL || rootAddresses == NULL)
+      outOfMemory();
+  }
+  object->root = rootCount;
+  roots[rootCount] = object->ptr;
+  rootAddresses[rootCount] = object->address;
+  rootCount++;
+}
+
+static void removeRoot(Object *object) {
+  if (object->root < 0)
+    return;
+  /* move the last root into the gap */
+  rootCount--;
+  roots[object->root] = roots[rootCount];
+  rootAddresses[object->root] = rootAddresses[rootCount];
+  roots[rootCount] = NULL;
+  if ((size_t)object->root != rootCount)
+    getObject(rootAddresses[object->root])->root = object->root;
+  object->root = -1;
+}
+
+static void deleteObject(Object *object) {
+  removeRoot(object);
+  object->address = 1;
+}
+
+static uint64_t collectionCount() {
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  return stats.collections;
+}
+
+/**
+ * Remember whatever the collector did during the last operation.
+ */
+static void finishOperation(uint64_t start, uint64_t collectionsBefore) {
+  uint64_t duration = now() - start;
+  operations++;
+  operationNs += duration;
+  SGC_Stats stats;
+  sgc_get_stats(&stats);
+  if (stats.collections != collectionsBefore) {
+    collections += stats.collections - collectionsBefore;
+    pauseTotalNs += duration;
+    if (duration > pauseMaxNs)
+      pauseMaxNs = duration;
+  }
+  if (stats.bytesAllocated > peakBytes)
+    peakBytes = stats.bytesAllocated;
+}
+
+static void replayMalloc(uint64_t address, uint64_t size) {
+  uint64_t collectionsBefore = collectionCount();
+  uint64_t start = now();
+  void *ptr = sgc_malloc(size);
+  finishOperation(start, collectionsBefore);
+  if (ptr == NULL)
+    outOfMemory();
+  /* keep it until the next recorded collection tells otherwise */
+  addRoot(addObject(address, ptr, size));
+}
+
+static void replayRealloc(uint64_t oldAddress, uint64_t address,
+                          uint64_t size) {
+  Object *object = getObject(oldAddress);
+  void *oldPtr = object != NULL ? object->ptr : NULL;
+  uint64_t collectionsBefore = collectionCount();
+  uint64_t start = now();
+  void *ptr = sgc_realloc(oldPtr, size);
+  finishOperation(start, collectionsBefore);
+  if (ptr == NULL)
+    outOfMemory();
+  int hasEdges = object != NULL && object->hasEdges;
+  if (object != NULL)
+    deleteObject(object);
+  object = addObject(address, ptr, size);
+  object->hasEdges = hasEdges;
+  addRoot(object);
+}
+
+static void replayFree(uint64_t address) {
+  Object *object = getObject(address);
+  if (object == NULL)
+    return;
+  void *ptr = object->ptr;
+  deleteObject(object);
+  uint64_t collectionsBefore = collectionCount();
+  uint64_t start = now();
+  sgc_free(ptr);
+  finishOperation(start, collectionsBefore);
+}
+
+/**
+ * Replace the reference graph by the one recorded at a collection.
+ */
+static void rebuildGraph() {
+  for (size_t i = 0; i < rootCount; i++) {
+    getObject(rootAddresses[i])->root = -1;
+    roots[i] = NULL;
+  }
+  rootCount = 0;
+  for (size_t i = 0; i < objectCapacity; i++) {
+    if (objects[i].address > 1 && objects[i].hasEdges) {
+      memset(objects[i].ptr, 0, objects[i].size);
+      objects[i].hasEdges = 0;
+    }
+  }
+
+  for (size_t i = 0; i < edgeCount; i++) {
+    Object *target = getObject(edges[i].target);
+    if (target == NULL)
+      continue;
+    Object *source = getObject(edges[i].source);
+    /* references from roots, from allocations unknown to the trace and
+     * crossing the end of the allocation are kept alive by the roots */
+    if (source == NULL || edges[i].offset + sizeof(void *) > source->size) {
+      addRoot(target);
+      continue;
+    }
+    memcpy((char *)source->ptr + edges[i].offset, &target->ptr,
+           sizeof(void *));
+    source->hasEdges = 1;
+  }
+  edgeCount = 0;
+}
+
+static void addEdge(uint64_t source, uint64_t offset, uint64_t target) {
+  if (edgeCount == edgeCapacity) {
+    edgeCapacity = edgeCapacity == 0 ? 1024 : edgeCapacity * 2;
+    edges = realloc(edges, edgeCapacity * sizeof(Edge));
+    if (edges == NULL)
+      outOfMemory();
+  }
+  edges[edgeCount].source = source;
+  edges[edgeCount].offset = offset;
+  edges[edgeCount].target = target;
+  edgeCount++;
+}
+
+static void replay(FILE *file, int forceCollections) {
+  char magic[4];
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "SGCT", 4) != 0 ||
+      readVarint(file) != 1) {
+    fprintf(stderr, "not a sgc allocation trace\n");
+    exit(1);
+  }
+  int inCollection = 0;
+  int tag;
+  while ((tag = getc(file)) != EOF) {
+    switch (tag) {
+    case 'M': {
+      uint64_t address = readVarint(file);
+      replayMalloc(address, readVarint(file));
+      break;
+    }
+    case 'R': {
+      uint64_t oldAddress = readVarint(file);
+      uint64_t address = readVarint(file);
+      replayRealloc(oldAddress, address, readVarint(file));
+      break;
+    }
+    case 'F': {
+      uint64_t address = readVarint(file);
+      if (inCollection) {
+        /* garbage of the trace, the collector will find it unreachable */
+        Object *object = getObject(address);
+        if (object != NULL)
+          deleteObject(object);
+      } else {
+        replayFree(address);
+      }
+      break;
+    }
+    case 'C':
+      inCollection = 1;
+      break;
+    case 'r':
+      addEdge(0, 0, readVarint(file));
+      break;
+    case 'e': {
+      uint64_t source = readVarint(file);
+      uint64_t offset = readVarint(file);
+      addEdge(source, offset, readVarint(file));
+      break;
+    }
+    case 'c': {
+      recordedPauseNs += readVarint(file);
+      recordedCollections++;
+      inCollection = 0;
+      rebuildGraph();
+      if (forceCollections) {
+        uint64_t collectionsBefore = collectionCount();
+        uint64_t start = now();
+        sgc_collect();
+        finishOperation(start, collectionsBefore);
+        operations--; /* not an operation of the trace */
+      }
+      break;
+    }
+    default:
+      fprintf(stderr, "invalid event '%c'\n", tag);
+      exit(1);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  sgc_init();
+  int forceCollections = argc == 3 && strcmp(argv[1], "-f") == 0;
+  if (argc != 2 && !forceCollections) {
+    fprintf(stderr, "usage: %s [-f] alloc.trace\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[argc - 1], "rb");
+  if (file == NULL) {
+    perror(argv[argc - 1]);
+    return 1;
+  }
+  replay(file, forceCollections);
+  fclose(file);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("operations      %12lu (%.0f/s)\n", (unsigned long)operations,
+         operationNs == 0 ? 0.0 : operations * 1e9 / operationNs);
+  printf("collections     %12lu (trace: %lu)\n", (unsigned long)collections,
+         (unsigned long)recordedCollections);
+  printf("pause total     %12.3f ms (trace: %.3f ms)\n", pauseTotalNs / 1e6,
+         recordedPauseNs / 1e6);
+  printf("pause max       %12.3f ms\n", pauseMaxNs / 1e6);
+  printf("pause average   %12.3f ms\n",
+         collections == 0 ? 0.0 : pauseTotalNs / 1e6 / collections);
+  printf("peak heap       %12lu bytes\n", (unsigned long)peakBytes);
+  printf("max rss         %12ld KB\n", usage.ru_maxrss);
+
+  sgc_exit();
+  return 0;
+}